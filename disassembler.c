@@ -1,412 +1,5133 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <immintrin.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define BUFFER_SIZE 1024
-#define MOV '0'
-#define ADD '1'
-#define SUB '2'
-#define CMP '3'
+#define CHUNK_SIZE (64 * 1024)          // read size when streaming from a pipe or stdin
+#define DECODE_WINDOW (1u << 30)        // most bytes handed to decode() at once, keeps offsets within unsigned
+#define MAX_INSTRUCTION_LENGTH 8        // longest encoding the decoders read: two prefixes, op, mod/rm, 16-bit disp, 16-bit data
+#define OUTPUT_SIZE (1 << 20)           // formatted text is collected in a buffer this big before it is written
+#define MAX_LINE_LENGTH 256             // longest line the formatter can produce for one instruction or trace step
+#define PARALLEL_CHUNK (4 << 20)        // bytes of an image each thread decodes at a time in parallel mode
+#define MAX_THREADS 64
+#define BENCH_ROUNDS 10                 // passes over each corpus per measurement of -bench
+#define BENCH_CORPUS_SIZE (4 << 20)     // bytes of each synthetic corpus -bench decodes, unless -size says otherwise
+#define BENCH_PROGRAM_SIZE 0xf000       // bytes of a corpus the simulation stages of -bench run, within one segment
+#define BENCH_DATA_SEGMENT 0x1000       // ds, es and ss of a simulated corpus, which keeps its stores out of the code
+#define SYNC_WINDOW 256                 // bytes into a speculative chunk where the true stream is looked for
+#define MEMORY_SIZE (1 << 20)           // the 8086 addresses 1 MB
+#define MEMORY_PAGE 4096                // granularity of the dirty page map, see store_byte()
+#define MEMORY_PAGES (MEMORY_SIZE / MEMORY_PAGE)
+#define MAX_BLOCK_LENGTH 32             // most instructions translated into one basic block
+#define BLOCK_POOL_SIZE 4096            // translated blocks kept before the translations are flushed
+#define ANALYSIS_WINDOW 0x10000         // offsets -analyze remembers behind it, as far back as a 16-bit jump reaches
+#define ACCESS_BATCH 4096               // memory accesses -accesses notes before counting them, see note_accesses()
+#define ACCESS_REGION 4096              // bytes of memory per row of the -accesses histogram
+#define ACCESS_REGIONS (MEMORY_SIZE / ACCESS_REGION)
 
-#define abs(x) (x < 0) ? (-x) : (x)
+// operations, see the operations table for their names and handlers
+#define NONE 0
+#define MOV 1
+#define ADD 2
+#define SUB 3
+#define CMP 4
+#define JUMP 5                          // conditional jumps, loops and jcxz
+#define PUSH 6
+#define POP 7
+#define XCHG 8
+#define IN 9
+#define OUT 10
+#define XLAT 11
+#define LEA 12
+#define LDS 13
+#define LES 14
+#define LAHF 15
+#define SAHF 16
+#define PUSHF 17
+#define POPF 18
+#define ADC 19
+#define SBB 20
+#define INC 21
+#define DEC 22
+#define NEG 23
+#define MUL 24
+#define IMUL 25
+#define DIV 26
+#define IDIV 27
+#define AAA 28
+#define DAA 29
+#define AAS 30
+#define DAS 31
+#define AAM 32
+#define AAD 33
+#define CBW 34
+#define CWD 35
+#define NOT 36
+#define SHL 37
+#define SHR 38
+#define SAR 39
+#define ROL 40
+#define ROR 41
+#define RCL 42
+#define RCR 43
+#define AND 44
+#define TEST 45
+#define OR 46
+#define XOR 47
+#define MOVS 48
+#define CMPS 49
+#define SCAS 50
+#define LODS 51
+#define STOS 52
+#define CALL 53
+#define JMP 54
+#define RET 55
+#define RETF 56
+#define INT 57
+#define INT3 58
+#define INTO 59
+#define IRET 60
+#define CLC 61
+#define CMC 62
+#define STC 63
+#define CLD 64
+#define STD 65
+#define CLI 66
+#define STI 67
+#define HLT 68
+#define WAIT 69
+#define LOCK 70                         // prefixes, only left as an operation when one can't apply to anything
+#define REP 71
+#define REPNE 72
+#define SEGMENT 73
+#define DB 74                           // a byte that starts no instruction, written out as data
+#define OPERATION_COUNT 75
+
+// operation flags
+#define OP_STRING 1                     // the name takes a b or w suffix
+#define OP_TRANSFER 2                   // may continue anywhere but the next instruction
+#define OP_STOP 4                       // the simulation may stop in front of it, see must_stop()
+
+// why a run stopped in front of cpu->ip
+#define STOP_RETURN 1                   // a RET with no CALL left to return from, out of the program
+#define STOP_HALT 2
+#define STOP_UNSUPPORTED 3              // an instruction the simulation can't execute
+
+// prefix bits of an instruction, with the segment register of an override in bits 4 and 5
+#define PREFIX_LOCK 1
+#define PREFIX_REP 2
+#define PREFIX_REPNE 4
+#define PREFIX_SEGMENT 8
+
+#define NO_GROUP 8                      // encoding row that isn't picked by the reg field of a group op code
+#define MAX_GROUPS 16                   // op codes whose reg field picks the operation
+
+// operand types
+#define OPERAND_NONE 0
+#define OPERAND_REGISTER 1              // reg holds (w << 3) | reg field, or 16 + sr for segment registers
+#define OPERAND_MEMORY 2                // reg holds rm, mod 0b00 with rm 0b110 is a direct address
+#define OPERAND_IMMEDIATE 3
+#define OPERAND_RELATIVE 4              // signed jump displacement
+#define OPERAND_FAR 5                   // segment:offset of a far call or jump, the segment goes in the source's value
+
+// operand flags
+#define OPERAND_SIGNED 1                // immediate was sign extended from 8 bits, print it as signed
+#define OPERAND_ACCUMULATOR 2           // register implied by an accumulator-only encoding, which has its own timing
+#define OPERAND_POINTER 4               // memory holding the offset and segment of a far call or jump
+#define OPERAND_EXACT 8                 // spell out encodings nasm would shorten, see decode_with_labels()
+
+// kinds of instructions the synthetic corpora of -bench are mixed from, see generate_corpus()
+#define KIND_REG 0                      // mov and ALU ops between two registers
+#define KIND_MEM8 1                     // the same with a memory operand and an 8-bit displacement
+#define KIND_MEM16 2                    // the same with a 16-bit displacement or a direct address
+#define KIND_IMM 3                      // immediate to register or accumulator
+#define KIND_JUMP 4                     // short conditional and unconditional jumps, always forward
+#define KIND_COUNT 5
+
+// kinds of memory access counted by -accesses, see note_accesses()
+#define ACCESS_WRITE 1
+#define ACCESS_WORD 2
+
+// processors the clock estimates can be made for
+#define CPU_8086 1
+#define CPU_8088 2
+
+// indices into the simulated register file, in the order the reg field encodes them
+#define AX 0
+#define CX 1
+#define DX 2
+#define BX 3
+#define SP 4
+#define BP 5
+#define SI 6
+#define DI 7
+#define ES 8
+#define CS 9
+#define SS 10
+#define DS 11
+
+// bits of the flags register
+#define FLAG_C (1 << 0)
+#define FLAG_P (1 << 2)
+#define FLAG_A (1 << 4)
+#define FLAG_Z (1 << 6)
+#define FLAG_S (1 << 7)
+#define FLAG_T (1 << 8)
+#define FLAG_I (1 << 9)
+#define FLAG_D (1 << 10)
+#define FLAG_O (1 << 11)
+
+// binary trace records, see record_step() for the layout. A step starts with a byte of these bits,
+// the other records have the top bit set
+#define STEP_REGISTERS 1                // count, then register index and new value for each
+#define STEP_FLAGS 2                    // new flags
+#define STEP_IP 4                       // new ip, when it is not the next instruction
+#define RECORD_CODE 0x80                // ip, size and the bytes of an instruction decoded at ip
+#define RECORD_RUN 0x81                 // variants of the whole recording, variant and path of this run
+#define RECORD_END 0x82                 // the run finished
+#define TRACE_MAGIC "86T1"              // starts every binary trace file
+#define SNAPSHOT_MAGIC "86S2"           // starts every machine state file, see save_snapshot()
+#define SNAPSHOT_HEADER 49              // bytes of a machine state file before its page map
+#define MAX_TRACE_PATH 4096             // longest input path a RECORD_RUN names, longer ones are cut
+#define NO_IP 0x10000                   // fast-forward target ip when the fast-forward doesn't stop at one
+
+// instrumentation a run loop is compiled with, see run_loops
+#define RUN_TRACE 1                     // text trace of every instruction
+#define RUN_CLOCKS 2                    // clock estimates
+#define RUN_PROFILE 4                   // per ip counters, needs RUN_CLOCKS
+#define RUN_RECORD 8                    // binary trace
+#define RUN_ACCESSES 16                 // memory access counts
 
 typedef unsigned char byte;
 
-void decode(const byte buffer[], size_t n);
-unsigned decode_mov_im_to_reg(const byte buffer[], unsigned i);
-unsigned decode_mov_mem_to_acc(const byte buffer[], unsigned i);
-unsigned decode_mov_acc_to_mem(const byte buffer[], unsigned i);
-unsigned decode_mov_im_to_rm(const byte buffer[], unsigned i);
-unsigned decode_rm_reg(const byte buffer[], unsigned i, char op);
-unsigned decode_arithmetic_im_to_rm(const byte buffer[], unsigned i);
-unsigned decode_im_to_acc(const byte buffer[], unsigned i, char op);
-unsigned print_effective_address(const byte buffer[], unsigned i, byte rm, byte mod);
-char* lookup_register(byte w, byte reg);
-char* lookup_effective_address(byte rm);
+// one operand of a decoded instruction
+struct operand {
+    byte type;
+    byte flags;
+    byte reg;
+    byte mod;
+    unsigned short value;               // displacement, direct address or immediate
+};
+
+// decoded instruction, filled by the decoders and turned into text by format_instruction()
+struct instruction {
+    byte op;
+    byte w;
+    byte size;                          // encoded length in bytes
+    byte cond;                          // condition of a JUMP, low nibble of the op code
+    byte prefixes;                      // PREFIX_ bits
+    struct operand dest;
+    struct operand source;
+};
+
+// text output collected in a large buffer and written out with few system calls. Without a file
+// (fd -1) the buffer grows instead, keeping everything in memory
+struct output {
+    char *data;
+    size_t used;
+    size_t size;
+    int fd;
+};
+
+// one chunk of an image decoded by a thread of decode_parallel(). Unless it is the first chunk of
+// a round, the chunk's start is a guess at an instruction boundary, so the thread notes where
+// its output stands at every instruction it decodes near the start. Whichever of those the true
+// instruction stream coming out of the previous chunk lands on, the output from there on is right
+struct decode_job {
+    const byte *image;
+    size_t start;                       // first instruction decoded
+    size_t end;                         // instructions starting before this are decoded
+    size_t landing;                     // just past the last decoded instruction
+    struct output out;
+    size_t sync[SYNC_WINDOW];           // out.used at the instruction starting at start + k, SIZE_MAX if none does
+};
+
+// state of the simulated machine. Flags are computed lazily: arithmetic only records its
+// operands and result, and the flag bits are worked out when a jump or the trace asks for them
+struct cpu {
+    unsigned short regs[12];            // ax cx dx bx sp bp si di es cs ss ds
+    unsigned short ip;
+    unsigned short flags;               // valid as of the last get_flags()
+    byte lazy_op;                       // operation whose flags are still pending, NONE if flags is current
+    byte lazy_w;
+    unsigned short lazy_dest;
+    unsigned short lazy_source;
+    unsigned short lazy_result;
+    byte *memory;                       // flat 1 MB address space
+    byte *dirty;                        // pages of memory stored to since the machine was reset, by MEMORY_PAGE
+    byte variant;                       // CPU_8086 or CPU_8088 to estimate clocks for, 0 to skip them
+    unsigned long long clocks;          // estimated clocks so far
+    struct profile_entry *profile;      // per ip counters when profiling, NULL otherwise
+    struct output *record;              // binary trace being written, NULL otherwise
+    struct biu *biu;                    // prefetch queue model adding stalls to the clocks, NULL for the manual's clocks alone
+    struct access_log *accesses;        // memory accesses being counted, NULL otherwise
+    byte stop;                          // STOP_ reason once the run stopped, 0 while it goes on
+    unsigned calls;                     // CALLs not returned from yet, see must_stop()
+
+    // predecode cache: the decoded instruction at every ip of the code segment. A size of 0 marks
+    // an entry that still has to be decoded, and covered marks the bytes entries were decoded
+    // from so that stores into them can invalidate the affected entries
+    struct instruction *decoded;
+    byte *covered;
+    unsigned short decoded_cs;          // code segment the cache was filled for, starts out as 0
+    unsigned code_base;                 // physical address of decoded_cs:0
+    byte code_dirty;                    // a store invalidated decoded instructions since the last check
+
+    // basic block translations used by run_blocks(), indexed by the ip they start at
+    struct block **blocks;
+    struct block *block_pool;
+    unsigned blocks_used;
+    unsigned program_size;
+};
+
+struct uop;
+typedef struct block *(*handler_fn)(struct cpu *cpu, const struct uop *uop);
+
+// an instruction translated for run_blocks(): a handler chosen for its operation and operand
+// types, plus the fields that handler needs already pulled out of the instruction record.
+// A cmp and the conditional jump after it are fused into a single uop
+struct uop {
+    handler_fn handler;
+    struct block *block;                // block this uop belongs to
+    unsigned short ip;                  // address of the instruction
+    unsigned short next_ip;             // address just past it
+    byte dest;                          // register file index of a register destination
+    byte source;                        // register file index of a register source
+    byte cond;                          // condition of a jump
+    unsigned short value;               // immediate
+    short displacement;                 // jump displacement
+    struct instruction inst;            // whole record, for the generic handler
+};
+
+// straight-line run of instructions ending at a jump, translated to uops. The last uop is
+// always a jump or fall through, which links the block to its successor on first use
+struct block {
+    struct block *next[2];              // successor when the jump is not taken / taken
+    unsigned short count;               // instructions in the block
+    struct uop uops[MAX_BLOCK_LENGTH + 1];
+};
+
+// where a fast-forward stops: at whichever of these comes first
+struct until {
+    unsigned ip;                        // before executing the instruction at ip, NO_IP for none
+    unsigned long long count;           // after this many instructions
+    unsigned long long clocks;          // once the clock estimate reaches this
+};
+
+// how main() asked for the program to be run
+struct options {
+    int exec;                           // simulate the program instead of disassembling it
+    int render;                         // the input is a binary trace to print as text
+    int labels;                         // name jump targets, in two passes over a mapped file
+    int analyze;                        // cost the basic blocks and loops of a mapped file without running it
+    int threads;                        // threads disassembling one mapped file
+    const char *record_path;            // where to write a binary trace of the simulation, or NULL
+    int trace;                          // print every executed instruction
+    int profile;                        // count executions and clocks per ip and print where they went
+    int accesses;                       // count memory accesses by region, width and alignment
+    struct output *record;              // binary trace file, NULL when not recording
+    byte variants;                      // every processor being run, for the banners
+    byte variant;                       // CPU_8086 or CPU_8088 to estimate clocks for, 0 to skip them
+    int biu;                            // add the stalls of a prefetch queue and bus model to the clocks
+    struct until until;                 // run untraced up to here first
+    int fast_forward;                   // until is set
+    const char *save_path;              // where to write the machine state, or NULL
+    int resume;                         // the input is a machine state file rather than a program
+    const byte *snapshot;               // the mapped machine state file when resuming
+    size_t snapshot_size;
+    const char *dump_path;              // where to write the memory image as a run ends, or NULL
+    const char *image_path;             // where to write the image region as a picture, or NULL
+    unsigned image_address;             // physical address of the image region, 4 bytes RGBA per pixel
+    unsigned image_width;
+    unsigned image_height;
+};
+
+// buffers a thread keeps from one input file to the next
+struct workspace {
+    struct cpu *cpu;
+    byte *program;                      // the program as read, copied into memory for every run
+};
+
+// one input of a batch. With a combined stream the result waits in memory until every earlier
+// job's result has been written
+struct batch_job {
+    const char *path;
+    struct output result;
+    int done;
+    int failed;                         // the input or its result file couldn't be opened, or wasn't valid
+};
+
+// the jobs a batch worker still owns, [head, tail). The owner takes from the head, idle workers
+// steal from the tail
+struct job_queue {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+};
+
+struct batch {
+    struct batch_job *jobs;
+    size_t count;
+    const struct options *options;
+    const char *outdir;                 // one output file per input in here, NULL for stdout in order
+    int workers;
+    struct job_queue queues[MAX_THREADS];
+
+    // finished results and the spare result buffers, handed between the workers and main()
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    struct output spare[MAX_THREADS * 2];
+    int spares;
+};
+
+struct batch_worker_args {
+    struct batch *batch;
+    int worker;                         // index of the worker's own queue
+};
+
+// what one ip cost over the whole run, see print_profile
+struct profile_entry {
+    unsigned long long count;           // times the instruction at this ip executed
+    unsigned long long clocks;          // estimated clocks spent in it
+};
+
+// clock estimate for one executed instruction, see the instruction timing tables in chapter 2 of the manual
+struct timing {
+    unsigned short base;                // clocks of the instruction itself
+    byte ea;                            // clocks to calculate the effective address
+    byte penalty;                       // clocks for word transfers the bus has to split in two
+    byte transfers;                     // bus cycles moving the memory operands, see biu_step()
+    unsigned short stall;               // clocks the execution unit waited on the bus, with -biu only
+};
+
+// the bus interface unit of -biu: the prefetch queue and the bus cycle filling it. The execution
+// unit takes instruction bytes out of the queue and borrows the bus for its own transfers
+struct biu {
+    byte capacity;                      // queue bytes, 6 on the 8086 and 4 on the 8088
+    byte queue;                         // bytes fetched ahead of ip
+    byte cycle;                         // clocks left of the fetch under way, 0 while the bus is idle
+    byte fetching;                      // bytes that fetch brings in
+    unsigned short next;                // offset in the code segment the next fetch reads
+    unsigned long long stalls;          // stall clocks of the whole run
+};
+
+// an instruction -analyze passed, kept in its window until ANALYSIS_WINDOW bytes later
+struct analysis_entry {
+    size_t offset;                      // where it starts, SIZE_MAX for a slot no instruction starts at
+    size_t previous;                    // where the instruction in front of it starts
+    unsigned long long clocks;          // clocks of every instruction in front of it
+    unsigned long long count;           // instructions in front of it
+};
+
+// where -analyze is in its pass over a file, see analyze()
+struct analysis {
+    const byte *image;
+    const byte *tail;                   // zero padded copy of the image from body on
+    size_t body;
+    struct cpu cpu;                     // a machine with all registers 0, only there for the variant
+    struct analysis_entry *window;      // by offset & (ANALYSIS_WINDOW - 1)
+    byte *pending;                      // forward jump targets not reached yet, a bit per offset of the window
+    size_t block;                       // where the current block starts
+    size_t last;                        // where the last instruction passed starts
+    unsigned long long block_clocks;    // clocks and count as the current block started
+    unsigned long long block_count;
+    unsigned long long clocks;          // clocks and count of every instruction passed
+    unsigned long long count;
+    unsigned long long blocks;
+    unsigned long long loops;
+};
+
+// one memory access as note_accesses() noted it, waiting to be counted
+struct access {
+    unsigned address;
+    unsigned short ip;                  // instruction that made it
+    byte kind;                          // ACCESS_ bits
+};
+
+// every memory access of a run with -accesses. Accesses are noted in a batch and counted a batch
+// at a time, which leaves the simulation with a store per access
+struct access_log {
+    unsigned used;                      // accesses in the batch
+    struct access batch[ACCESS_BATCH];
+    unsigned long long regions[ACCESS_REGIONS][4];  // accesses per region by kind
+    unsigned long long odd[ACCESS_REGIONS];         // word accesses at an odd address per region
+    unsigned long long odd_ips[0x10000];            // word accesses at an odd address per ip
+};
+
+// where the memory accesses of an instruction go, worked out by locate_accesses() before it
+// changes any registers
+struct access_site {
+    unsigned memory;                    // physical address of the memory operand, or of the byte xlat reads
+    unsigned stack;                     // physical address of ss:0
+    unsigned source;                    // base of the segment a string instruction reads
+    unsigned dest;                      // base of es, which a string instruction writes
+    unsigned short sp;
+    unsigned short si;
+    unsigned short di;
+    short step;                         // what si and di move by per string element
+};
+
+// an ip of the -accesses report and how many word accesses at odd addresses it made
+struct odd_access {
+    unsigned long long count;
+    unsigned short ip;
+};
+
+// a synthetic corpus for -bench: how many of every KIND_ of instruction it has, relative to the others
+struct corpus_mix {
+    const char *name;
+    byte weights[KIND_COUNT];
+};
+
+struct cpu;
+typedef void (*run_fn)(struct cpu *cpu, unsigned program_size, struct output *out);
+
+// every decoder takes the same arguments, one that doesn't need some of them casts them to void
+typedef unsigned (*decoder_fn)(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+
+// entry of the first-byte dispatch table: the decoder for the op code along with its operation and width.
+// For the op codes of a group the decoder is decode_group() and op is the group's row of group_table
+struct opcode {
+    decoder_fn decoder;
+    byte op;
+    byte w;
+};
+
+// one row of the encodings table. The pattern spells out the first byte from the top bit down:
+// 0 and 1 must match, w is the width bit and other letters are fields the decoder reads itself
+struct encoding {
+    const char *pattern;
+    byte group;                         // reg field of the mod/rm byte that selects this row, or NO_GROUP
+    byte op;
+    decoder_fn decoder;
+};
+
+typedef int (*execute_fn)(struct cpu *cpu, const struct instruction *inst);
+
+// what every decoder and handler needs to know about an operation
+struct operation {
+    const char *name;
+    execute_fn execute;                 // runs it, returns whether it jumped. NULL if it can't be simulated
+    byte flags;                         // OP_ bits
+    byte clocks;                        // clocks of the register form in the manual, see estimate_clocks()
+};
+
+size_t decode(const byte buffer[], size_t n, struct output *out);
+void decode_mapped(const byte image[], size_t size, int threads, struct output *out);
+size_t decode_parallel(const byte image[], size_t size, int threads, struct output *out);
+void *decode_chunk(void *arg);
+void decode_stream(int fd, struct output *out);
+void decode_labeled(const byte image[], size_t size, struct output *out);
+size_t mark_targets(const byte buffer[], size_t origin, size_t i, size_t end, size_t size, byte starts[], byte targets[]);
+size_t decode_with_labels(const byte buffer[], size_t origin, size_t i, size_t end, size_t size, const byte starts[], const byte targets[], struct output *out);
+void analyze(const byte image[], size_t size, byte variant, struct output *out);
+size_t analyze_range(struct analysis *state, const byte buffer[], size_t origin, size_t i, size_t end, size_t size, struct output *out);
+void analysis_row(struct analysis *state, size_t start, size_t last, unsigned long long clocks, unsigned long long count, const char *note, struct output *out);
+void end_block(struct analysis *state, size_t end, size_t last, unsigned long long clocks, unsigned long long count, struct output *out);
+void init_decode_table(void);
+void init_length_table(void);
+double seconds(void);
+int bench_suite(const char *mix, size_t size);
+void bench_corpus(const struct corpus_mix *mix, size_t size);
+void bench_report(const char *corpus, const char *stage, size_t bytes, unsigned long long instructions, double best, unsigned long long cycles);
+int parse_mix(const char *spec, struct corpus_mix *mix);
+size_t generate_corpus(byte corpus[], size_t size, const struct corpus_mix *mix, unsigned seed, unsigned long long *instructions);
+unsigned next_random(unsigned *state);
+unsigned long long decode_records(const byte buffer[], size_t n);
+void bench_reset(struct cpu *cpu);
+int match_pattern(const char *pattern, byte b);
+unsigned decode_group(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_prefix(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_jump(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_near(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_far(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_unknown(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_none(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_aam(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_data8(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_data16(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_mov_im_to_reg(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_mov_mem_to_acc(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_mov_acc_to_mem(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_im_to_rm(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_mov_segment(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_rm_reg(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_rm(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_rm_far(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_shift(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_load_pointer(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_reg16(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_xchg_acc(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_segment_register(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_port(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_arithmetic_im_to_rm(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_im_to_acc(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst);
+unsigned decode_register_or_memory(const byte buffer[], unsigned i, byte w, struct operand *operand);
+unsigned decode_effective_address(const byte buffer[], unsigned i, byte rm, byte mod, struct operand *operand);
+void format_instruction(struct output *out, const struct instruction *inst);
+void format_operand(struct output *out, const struct instruction *inst, const struct operand *operand);
+void output_init(struct output *out, int fd);
+void output_reserve(struct output *out);
+void output_flush(struct output *out);
+void output_bytes(struct output *out, const char *data, size_t n);
+void write_all(int fd, const char *data, size_t n);
+void output_string(struct output *out, const char *string);
+void output_unsigned(struct output *out, unsigned long long value);
+void output_padded(struct output *out, unsigned long long value, int width);
+void output_signed(struct output *out, int value);
+void output_hex(struct output *out, unsigned value, int digits);
+void output_flags(struct output *out, unsigned short flags);
+int load_program(int fd, byte memory[]);
+int process_file(struct output *out, const char *path, struct options options, struct workspace *workspace);
+int run_batch(char *paths[], size_t count, const struct options *options, const char *outdir);
+void *batch_worker(void *arg);
+size_t take_job(struct batch *batch, int worker);
+int read_manifest(const char *manifest, char ***paths, size_t *count);
+void run_program(struct output *out, const char *path, const byte program[], int program_size, const struct options *options, struct cpu *cpu);
+void print_banner(struct output *out, byte variants, byte variant);
+void print_execution_header(struct output *out, const char *path);
+void run_fast(struct cpu *cpu, unsigned program_size, struct output *out);
+unsigned long long fast_forward(struct cpu *cpu, unsigned program_size, const struct until *until);
+int parse_until(const char *spec, struct until *until);
+int save_snapshot(struct cpu *cpu, unsigned program_size, const char *path);
+int restore_snapshot(struct cpu *cpu, const byte snapshot[], size_t size);
+unsigned dirty_run(const struct cpu *cpu, unsigned page, unsigned *end);
+int dump_memory(const struct cpu *cpu, const char *path);
+int dump_image(const struct cpu *cpu, const char *path, unsigned address, unsigned width, unsigned height);
+extern run_fn run_loops[32];
+void record_step(struct output *record, const struct cpu *before, struct cpu *after, const struct instruction *inst, const struct timing *timing);
+void record_code(struct output *record, const struct cpu *cpu, const struct instruction *inst);
+void output_word(struct output *out, unsigned short value);
+int render_trace(struct output *out, const byte trace[], size_t size);
+int execute(struct cpu *cpu, const struct instruction *inst);
+int execute_mov(struct cpu *cpu, const struct instruction *inst);
+int execute_push(struct cpu *cpu, const struct instruction *inst);
+int execute_pop(struct cpu *cpu, const struct instruction *inst);
+int execute_xchg(struct cpu *cpu, const struct instruction *inst);
+int execute_xlat(struct cpu *cpu, const struct instruction *inst);
+int execute_load_address(struct cpu *cpu, const struct instruction *inst);
+int execute_flags_transfer(struct cpu *cpu, const struct instruction *inst);
+int execute_arithmetic(struct cpu *cpu, const struct instruction *inst);
+int execute_increment(struct cpu *cpu, const struct instruction *inst);
+int execute_neg(struct cpu *cpu, const struct instruction *inst);
+int execute_multiply(struct cpu *cpu, const struct instruction *inst);
+int execute_divide(struct cpu *cpu, const struct instruction *inst);
+int execute_adjust(struct cpu *cpu, const struct instruction *inst);
+int execute_convert(struct cpu *cpu, const struct instruction *inst);
+int execute_not(struct cpu *cpu, const struct instruction *inst);
+int execute_shift(struct cpu *cpu, const struct instruction *inst);
+int execute_logic(struct cpu *cpu, const struct instruction *inst);
+int execute_string(struct cpu *cpu, const struct instruction *inst);
+int execute_jump(struct cpu *cpu, const struct instruction *inst);
+int execute_call(struct cpu *cpu, const struct instruction *inst);
+int execute_jmp(struct cpu *cpu, const struct instruction *inst);
+int execute_return(struct cpu *cpu, const struct instruction *inst);
+int execute_interrupt(struct cpu *cpu, const struct instruction *inst);
+int execute_iret(struct cpu *cpu, const struct instruction *inst);
+int execute_flag_control(struct cpu *cpu, const struct instruction *inst);
+int execute_nothing(struct cpu *cpu, const struct instruction *inst);
+void interrupt(struct cpu *cpu, byte type);
+void far_transfer(struct cpu *cpu, unsigned short segment, unsigned short offset);
+void push_word(struct cpu *cpu, unsigned short value);
+unsigned short pop_word(struct cpu *cpu);
+unsigned short read_word(const struct cpu *cpu, unsigned address);
+void write_word(struct cpu *cpu, unsigned address, unsigned short value);
+void locate_accesses(const struct cpu *cpu, const struct instruction *inst, struct access_site *site);
+void note_accesses(struct access_log *log, const struct cpu *cpu, const struct instruction *inst, const struct access_site *site, int taken, unsigned short ip, unsigned short count);
+void note_access(struct access_log *log, unsigned address, unsigned short ip, byte kind);
+void count_accesses(struct access_log *log);
+void print_accesses(struct output *out, struct cpu *cpu);
+int compare_odd_access(const void *a, const void *b);
+int must_stop(struct cpu *cpu, const struct instruction *inst);
+void print_stop(struct output *out, const struct instruction *inst, unsigned short ip);
+void estimate_clocks(const struct cpu *cpu, const struct instruction *inst, struct timing *timing);
+void settle_clocks(const struct cpu *cpu, const struct instruction *inst, int taken, unsigned short count, struct timing *timing);
+byte ea_clocks(const struct operand *operand);
+void trace_clocks(struct output *out, const struct timing *timing, unsigned long long total);
+void biu_step(struct cpu *cpu, const struct instruction *inst, int flushed, unsigned short count, struct timing *timing);
+unsigned biu_run(struct biu *biu, unsigned clocks, unsigned bytes);
+void cpu_init(struct cpu *cpu);
+void cpu_reset(struct cpu *cpu);
+void cpu_free(struct cpu *cpu);
+const struct instruction *fetch(struct cpu *cpu);
+void flush_decoded(struct cpu *cpu);
+void invalidate_decoded(struct cpu *cpu, unsigned offset);
+void store_byte(struct cpu *cpu, unsigned address, byte value);
+void trace_changes(struct output *out, const struct cpu *before, struct cpu *after);
+void print_registers(struct output *out, struct cpu *cpu);
+void print_profile(struct output *out, struct cpu *cpu);
+void output_percent(struct output *out, unsigned long long part, unsigned long long total);
+unsigned short read_operand(const struct cpu *cpu, const struct instruction *inst, const struct operand *operand);
+void write_operand(struct cpu *cpu, const struct instruction *inst, const struct operand *operand, unsigned short value);
+unsigned physical_address(const struct cpu *cpu, const struct instruction *inst, const struct operand *operand);
+unsigned short effective_offset(const struct cpu *cpu, const struct operand *operand);
+unsigned segment_base(const struct cpu *cpu, const struct instruction *inst, byte segment);
+void set_result_flags(struct cpu *cpu, byte w, unsigned short result);
+unsigned short get_flags(struct cpu *cpu);
+int jump_taken(struct cpu *cpu, byte cond);
+int compare_taken(struct cpu *cpu, unsigned short a, unsigned short b, byte cond);
+void record_flags(struct cpu *cpu, byte op, byte w, unsigned short dest, unsigned short source, unsigned short result);
+void run_blocks(struct cpu *cpu, unsigned program_size);
+struct block *lookup_block(struct cpu *cpu, unsigned short ip);
+struct block *translate_block(struct cpu *cpu, unsigned short ip);
+void flush_blocks(struct cpu *cpu);
+struct block *chain(struct cpu *cpu, const struct uop *uop, int taken);
+struct block *uop_generic(struct cpu *cpu, const struct uop *uop);
+struct block *uop_mov_imm(struct cpu *cpu, const struct uop *uop);
+struct block *uop_mov_reg(struct cpu *cpu, const struct uop *uop);
+struct block *uop_add_imm(struct cpu *cpu, const struct uop *uop);
+struct block *uop_add_reg(struct cpu *cpu, const struct uop *uop);
+struct block *uop_sub_imm(struct cpu *cpu, const struct uop *uop);
+struct block *uop_sub_reg(struct cpu *cpu, const struct uop *uop);
+struct block *uop_cmp_imm(struct cpu *cpu, const struct uop *uop);
+struct block *uop_cmp_reg(struct cpu *cpu, const struct uop *uop);
+struct block *uop_jump(struct cpu *cpu, const struct uop *uop);
+struct block *uop_cmp_imm_jump(struct cpu *cpu, const struct uop *uop);
+struct block *uop_cmp_reg_jump(struct cpu *cpu, const struct uop *uop);
+struct block *uop_fall_through(struct cpu *cpu, const struct uop *uop);
+struct block *uop_transfer(struct cpu *cpu, const struct uop *uop);
+char* lookup_register(byte reg);
+char* lookup_effective_address(byte rm);
+
+struct opcode decode_table[256];    // indexed by the first byte of an instruction
+struct opcode group_table[MAX_GROUPS][8];   // op codes of a group by the reg field of their mod/rm byte
+
+// instruction length by first byte, as used by mark_targets(): the length with a register operand
+// (mod 11), with bit 7 set if the second byte is a mod/rm byte whose displacement adds to it. 0
+// marks an op code whose length depends on more than that, left to its decoder
+byte length_table[256];
+
+// jump mnemonics indexed by condition: the low nibble of 0111 cccc for the conditional jumps,
+// followed by the loops and jcxz (1110 00cc)
+char* jump_names[20] = {
+    "jo", "jno", "jb", "jnb", "je", "jne", "jbe", "ja",
+    "js", "jns", "jp", "jnp", "jl", "jnl", "jle", "jg",
+    "loopnz", "loopz", "loop", "jcxz"
+};
+
+// names, handlers and clocks by operation. JUMP takes its name from jump_names, and the clocks of
+// operations whose timing depends on their operands are worked out in estimate_clocks()
+const struct operation operations[OPERATION_COUNT] = {
+    [NONE] = {"", NULL, 0, 0},
+    [MOV] = {"mov", execute_mov, 0, 0},
+    [PUSH] = {"push", execute_push, 0, 0},
+    [POP] = {"pop", execute_pop, 0, 0},
+    [XCHG] = {"xchg", execute_xchg, 0, 0},
+    [IN] = {"in", NULL, 0, 10},
+    [OUT] = {"out", NULL, 0, 10},
+    [XLAT] = {"xlat", execute_xlat, 0, 11},
+    [LEA] = {"lea", execute_load_address, 0, 2},
+    [LDS] = {"lds", execute_load_address, 0, 16},
+    [LES] = {"les", execute_load_address, 0, 16},
+    [LAHF] = {"lahf", execute_flags_transfer, 0, 4},
+    [SAHF] = {"sahf", execute_flags_transfer, 0, 4},
+    [PUSHF] = {"pushf", execute_flags_transfer, 0, 10},
+    [POPF] = {"popf", execute_flags_transfer, 0, 8},
+    [ADD] = {"add", execute_arithmetic, 0, 0},
+    [ADC] = {"adc", execute_arithmetic, 0, 0},
+    [INC] = {"inc", execute_increment, 0, 0},
+    [AAA] = {"aaa", execute_adjust, 0, 8},
+    [DAA] = {"daa", execute_adjust, 0, 4},
+    [SUB] = {"sub", execute_arithmetic, 0, 0},
+    [SBB] = {"sbb", execute_arithmetic, 0, 0},
+    [DEC] = {"dec", execute_increment, 0, 0},
+    [NEG] = {"neg", execute_neg, 0, 0},
+    [CMP] = {"cmp", execute_arithmetic, 0, 0},
+    [AAS] = {"aas", execute_adjust, 0, 8},
+    [DAS] = {"das", execute_adjust, 0, 4},
+    [MUL] = {"mul", execute_multiply, 0, 0},
+    [IMUL] = {"imul", execute_multiply, 0, 0},
+    [AAM] = {"aam", execute_adjust, 0, 83},
+    [DIV] = {"div", execute_divide, 0, 0},
+    [IDIV] = {"idiv", execute_divide, 0, 0},
+    [AAD] = {"aad", execute_adjust, 0, 60},
+    [CBW] = {"cbw", execute_convert, 0, 2},
+    [CWD] = {"cwd", execute_convert, 0, 5},
+    [NOT] = {"not", execute_not, 0, 0},
+    [SHL] = {"shl", execute_shift, 0, 0},
+    [SHR] = {"shr", execute_shift, 0, 0},
+    [SAR] = {"sar", execute_shift, 0, 0},
+    [ROL] = {"rol", execute_shift, 0, 0},
+    [ROR] = {"ror", execute_shift, 0, 0},
+    [RCL] = {"rcl", execute_shift, 0, 0},
+    [RCR] = {"rcr", execute_shift, 0, 0},
+    [AND] = {"and", execute_logic, 0, 0},
+    [TEST] = {"test", execute_logic, 0, 0},
+    [OR] = {"or", execute_logic, 0, 0},
+    [XOR] = {"xor", execute_logic, 0, 0},
+    [MOVS] = {"movs", execute_string, OP_STRING, 18},
+    [CMPS] = {"cmps", execute_string, OP_STRING, 22},
+    [SCAS] = {"scas", execute_string, OP_STRING, 15},
+    [LODS] = {"lods", execute_string, OP_STRING, 12},
+    [STOS] = {"stos", execute_string, OP_STRING, 11},
+    [CALL] = {"call", execute_call, OP_TRANSFER, 0},
+    [JMP] = {"jmp", execute_jmp, OP_TRANSFER, 0},
+    [RET] = {"ret", execute_return, OP_TRANSFER | OP_STOP, 8},
+    [RETF] = {"retf", execute_return, OP_TRANSFER, 18},
+    [JUMP] = {"", execute_jump, OP_TRANSFER, 0},
+    [INT] = {"int", execute_interrupt, OP_TRANSFER, 51},
+    [INT3] = {"int3", execute_interrupt, OP_TRANSFER, 52},
+    [INTO] = {"into", execute_interrupt, OP_TRANSFER, 4},
+    [IRET] = {"iret", execute_iret, OP_TRANSFER, 24},
+    [CLC] = {"clc", execute_flag_control, 0, 2},
+    [CMC] = {"cmc", execute_flag_control, 0, 2},
+    [STC] = {"stc", execute_flag_control, 0, 2},
+    [CLD] = {"cld", execute_flag_control, 0, 2},
+    [STD] = {"std", execute_flag_control, 0, 2},
+    [CLI] = {"cli", execute_flag_control, 0, 2},
+    [STI] = {"sti", execute_flag_control, 0, 2},
+    [HLT] = {"hlt", execute_nothing, OP_STOP, 2},
+    [WAIT] = {"wait", execute_nothing, 0, 3},
+    [LOCK] = {"lock", NULL, 0, 0},
+    [REP] = {"rep", NULL, 0, 0},
+    [REPNE] = {"repne", NULL, 0, 0},
+    [SEGMENT] = {"db", NULL, 0, 0},
+    [DB] = {"db", NULL, 0, 0},
+};
+
+// the instruction set, in the order of the instruction encoding tables in chapter 4 of the
+// manual. init_decode_table() compiles it into decode_table and group_table; where two rows
+// match the same op code the first one wins
+const struct encoding encodings[] = {
+    // data transfer
+    {"100010dw", NO_GROUP, MOV, decode_rm_reg},
+    {"1100011w", 0, MOV, decode_im_to_rm},
+    {"1011wrrr", NO_GROUP, MOV, decode_mov_im_to_reg},
+    {"1010000w", NO_GROUP, MOV, decode_mov_mem_to_acc},
+    {"1010001w", NO_GROUP, MOV, decode_mov_acc_to_mem},
+    {"100011d0", NO_GROUP, MOV, decode_mov_segment},
+    {"11111111", 6, PUSH, decode_rm},
+    {"01010rrr", NO_GROUP, PUSH, decode_reg16},
+    {"000ss110", NO_GROUP, PUSH, decode_segment_register},
+    {"10001111", 0, POP, decode_rm},
+    {"01011rrr", NO_GROUP, POP, decode_reg16},
+    {"000ss111", NO_GROUP, POP, decode_segment_register},
+    {"1000011w", NO_GROUP, XCHG, decode_rm_reg},
+    {"10010rrr", NO_GROUP, XCHG, decode_xchg_acc},
+    {"1110v10w", NO_GROUP, IN, decode_port},
+    {"1110v11w", NO_GROUP, OUT, decode_port},
+    {"11010111", NO_GROUP, XLAT, decode_none},
+    {"10001101", NO_GROUP, LEA, decode_load_pointer},
+    {"11000101", NO_GROUP, LDS, decode_load_pointer},
+    {"11000100", NO_GROUP, LES, decode_load_pointer},
+    {"10011111", NO_GROUP, LAHF, decode_none},
+    {"10011110", NO_GROUP, SAHF, decode_none},
+    {"10011100", NO_GROUP, PUSHF, decode_none},
+    {"10011101", NO_GROUP, POPF, decode_none},
+
+    // arithmetic
+    {"000000dw", NO_GROUP, ADD, decode_rm_reg},
+    {"100000sw", 0, ADD, decode_arithmetic_im_to_rm},
+    {"0000010w", NO_GROUP, ADD, decode_im_to_acc},
+    {"000100dw", NO_GROUP, ADC, decode_rm_reg},
+    {"100000sw", 2, ADC, decode_arithmetic_im_to_rm},
+    {"0001010w", NO_GROUP, ADC, decode_im_to_acc},
+    {"1111111w", 0, INC, decode_rm},
+    {"01000rrr", NO_GROUP, INC, decode_reg16},
+    {"00110111", NO_GROUP, AAA, decode_none},
+    {"00100111", NO_GROUP, DAA, decode_none},
+    {"001010dw", NO_GROUP, SUB, decode_rm_reg},
+    {"100000sw", 5, SUB, decode_arithmetic_im_to_rm},
+    {"0010110w", NO_GROUP, SUB, decode_im_to_acc},
+    {"000110dw", NO_GROUP, SBB, decode_rm_reg},
+    {"100000sw", 3, SBB, decode_arithmetic_im_to_rm},
+    {"0001110w", NO_GROUP, SBB, decode_im_to_acc},
+    {"1111111w", 1, DEC, decode_rm},
+    {"01001rrr", NO_GROUP, DEC, decode_reg16},
+    {"1111011w", 3, NEG, decode_rm},
+    {"001110dw", NO_GROUP, CMP, decode_rm_reg},
+    {"100000sw", 7, CMP, decode_arithmetic_im_to_rm},
+    {"0011110w", NO_GROUP, CMP, decode_im_to_acc},
+    {"00111111", NO_GROUP, AAS, decode_none},
+    {"00101111", NO_GROUP, DAS, decode_none},
+    {"1111011w", 4, MUL, decode_rm},
+    {"1111011w", 5, IMUL, decode_rm},
+    {"11010100", NO_GROUP, AAM, decode_aam},
+    {"1111011w", 6, DIV, decode_rm},
+    {"1111011w", 7, IDIV, decode_rm},
+    {"11010101", NO_GROUP, AAD, decode_aam},
+    {"10011000", NO_GROUP, CBW, decode_none},
+    {"10011001", NO_GROUP, CWD, decode_none},
+
+    // logic
+    {"1111011w", 2, NOT, decode_rm},
+    {"110100vw", 4, SHL, decode_shift},
+    {"110100vw", 5, SHR, decode_shift},
+    {"110100vw", 7, SAR, decode_shift},
+    {"110100vw", 0, ROL, decode_shift},
+    {"110100vw", 1, ROR, decode_shift},
+    {"110100vw", 2, RCL, decode_shift},
+    {"110100vw", 3, RCR, decode_shift},
+    {"001000dw", NO_GROUP, AND, decode_rm_reg},
+    {"100000sw", 4, AND, decode_arithmetic_im_to_rm},
+    {"0010010w", NO_GROUP, AND, decode_im_to_acc},
+    {"1000010w", NO_GROUP, TEST, decode_rm_reg},
+    {"1111011w", 0, TEST, decode_im_to_rm},
+    {"1010100w", NO_GROUP, TEST, decode_im_to_acc},
+    {"000010dw", NO_GROUP, OR, decode_rm_reg},
+    {"100000sw", 1, OR, decode_arithmetic_im_to_rm},
+    {"0000110w", NO_GROUP, OR, decode_im_to_acc},
+    {"001100dw", NO_GROUP, XOR, decode_rm_reg},
+    {"100000sw", 6, XOR, decode_arithmetic_im_to_rm},
+    {"0011010w", NO_GROUP, XOR, decode_im_to_acc},
+
+    // string manipulation
+    {"1010010w", NO_GROUP, MOVS, decode_none},
+    {"1010011w", NO_GROUP, CMPS, decode_none},
+    {"1010111w", NO_GROUP, SCAS, decode_none},
+    {"1010110w", NO_GROUP, LODS, decode_none},
+    {"1010101w", NO_GROUP, STOS, decode_none},
+
+    // control transfer
+    {"11101000", NO_GROUP, CALL, decode_near},
+    {"11111111", 2, CALL, decode_rm},
+    {"10011010", NO_GROUP, CALL, decode_far},
+    {"11111111", 3, CALL, decode_rm_far},
+    {"11101001", NO_GROUP, JMP, decode_near},
+    {"11101011", NO_GROUP, JMP, decode_jump},
+    {"11111111", 4, JMP, decode_rm},
+    {"11101010", NO_GROUP, JMP, decode_far},
+    {"11111111", 5, JMP, decode_rm_far},
+    {"11000011", NO_GROUP, RET, decode_none},
+    {"11000010", NO_GROUP, RET, decode_data16},
+    {"11001011", NO_GROUP, RETF, decode_none},
+    {"11001010", NO_GROUP, RETF, decode_data16},
+    {"0111cccc", NO_GROUP, JUMP, decode_jump},
+    {"111000cc", NO_GROUP, JUMP, decode_jump},
+    {"11001101", NO_GROUP, INT, decode_data8},
+    {"11001100", NO_GROUP, INT3, decode_none},
+    {"11001110", NO_GROUP, INTO, decode_none},
+    {"11001111", NO_GROUP, IRET, decode_none},
+
+    // processor control
+    {"11111000", NO_GROUP, CLC, decode_none},
+    {"11110101", NO_GROUP, CMC, decode_none},
+    {"11111001", NO_GROUP, STC, decode_none},
+    {"11111100", NO_GROUP, CLD, decode_none},
+    {"11111101", NO_GROUP, STD, decode_none},
+    {"11111010", NO_GROUP, CLI, decode_none},
+    {"11111011", NO_GROUP, STI, decode_none},
+    {"11110100", NO_GROUP, HLT, decode_none},
+    {"10011011", NO_GROUP, WAIT, decode_none},
+    {"11110000", NO_GROUP, LOCK, decode_prefix},
+    {"11110011", NO_GROUP, REP, decode_prefix},
+    {"11110010", NO_GROUP, REPNE, decode_prefix},
+    {"001ss110", NO_GROUP, SEGMENT, decode_prefix},
+};
+
+// not taken and taken clocks of the conditional jumps, then loopnz, loopz, loop and jcxz
+byte jump_clocks[5][2] = {{4, 16}, {5, 19}, {6, 18}, {5, 17}, {6, 18}};
+
+// names of the KIND_ values, as -mix takes them
+const char *kind_names[KIND_COUNT] = {"reg", "mem8", "mem16", "imm", "jump"};
+
+// the corpora -bench times when no -mix is given, one per kind and a blend roughly like the listings
+const struct corpus_mix bench_mixes[] = {
+    {"reg",   {1, 0, 0, 0, 0}},
+    {"mem8",  {0, 1, 0, 0, 0}},
+    {"mem16", {0, 0, 1, 0, 0}},
+    {"imm",   {0, 0, 0, 1, 0}},
+    {"jump",  {0, 0, 0, 0, 1}},
+    {"mixed", {4, 2, 1, 2, 1}},
+};
+
+int main(int argc, char *argv[]) {
+    struct options options = {.trace = 1, .threads = 1, .until = {NO_IP, ~0ULL, ~0ULL},
+                              .image_address = 256, .image_width = 64, .image_height = 64};
+    int batch = 0;              // every path is an input, spread over a pool of threads
+    char *manifest = NULL;      // file listing more inputs for the batch, one per line
+    char *outdir = NULL;        // where the batch writes one result per input
+    int suite = 0;              // time decoding and simulation of synthetic corpora, no inputs
+    char *mix = NULL;           // the one corpus the suite should time, NULL for all of bench_mixes
+    size_t size = BENCH_CORPUS_SIZE;
+    char **paths = malloc(argc * sizeof(char *));
+    size_t path_count = 0;
+    assert(paths != NULL);
+
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "-exec") == 0) {
+            options.exec = 1;
+        } else if (strcmp(argv[a], "-quiet") == 0) {
+            options.trace = 0;
+        } else if (strcmp(argv[a], "-profile") == 0) {
+            options.profile = 1;
+        } else if (strcmp(argv[a], "-accesses") == 0) {
+            options.accesses = 1;
+        } else if (strcmp(argv[a], "-record") == 0 && a + 1 < argc) {
+            options.record_path = argv[++a];
+        } else if (strcmp(argv[a], "-until") == 0 && a + 1 < argc) {
+            if (parse_until(argv[++a], &options.until) != 0) {
+                fprintf(stderr, "bad fast-forward point %s, expected ip=<n>, count=<n> or clocks=<n>\n", argv[a]);
+                return 1;
+            }
+            options.fast_forward = 1;
+        } else if (strcmp(argv[a], "-save") == 0 && a + 1 < argc) {
+            options.save_path = argv[++a];
+        } else if (strcmp(argv[a], "-resume") == 0) {
+            options.resume = 1;
+        } else if (strcmp(argv[a], "-dump") == 0 && a + 1 < argc) {
+            options.dump_path = argv[++a];
+        } else if (strcmp(argv[a], "-image") == 0 && a + 1 < argc) {
+            options.image_path = argv[++a];
+        } else if (strcmp(argv[a], "-image-at") == 0 && a + 1 < argc) {
+            char *end;
+            options.image_address = strtoul(argv[++a], &end, 0);
+            if (sscanf(end, ",%ux%u", &options.image_width, &options.image_height) != 2 || options.image_address >= MEMORY_SIZE) {
+                fprintf(stderr, "bad image region %s, expected <address>,<width>x<height>\n", argv[a]);
+                return 1;
+            }
+        } else if (strcmp(argv[a], "-threads") == 0 && a + 1 < argc) {
+            options.threads = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "-labels") == 0) {
+            options.labels = 1;
+        } else if (strcmp(argv[a], "-analyze") == 0) {
+            options.analyze = 1;
+        } else if (strcmp(argv[a], "-bench") == 0) {
+            suite = 1;
+        } else if (strcmp(argv[a], "-mix") == 0 && a + 1 < argc) {
+            mix = argv[++a];
+        } else if (strcmp(argv[a], "-size") == 0 && a + 1 < argc) {
+            size = (size_t)atoi(argv[++a]) << 20;
+        } else if (strcmp(argv[a], "-render") == 0) {
+            options.render = 1;
+        } else if (strcmp(argv[a], "-8086") == 0) {
+            options.variants |= CPU_8086;
+        } else if (strcmp(argv[a], "-8088") == 0) {
+            options.variants |= CPU_8088;
+        } else if (strcmp(argv[a], "-biu") == 0) {
+            options.biu = 1;
+        } else if (strcmp(argv[a], "-batch") == 0) {
+            batch = 1;
+        } else if (strcmp(argv[a], "-manifest") == 0 && a + 1 < argc) {
+            manifest = argv[++a];
+        } else if (strcmp(argv[a], "-outdir") == 0 && a + 1 < argc) {
+            outdir = argv[++a];
+        } else {
+            paths[path_count++] = argv[a];
+        }
+    }
+    size_t listed = path_count; // paths from here on are copies read from the manifest
+    if (batch && manifest != NULL && read_manifest(manifest, &paths, &path_count) != 0) {
+        fprintf(stderr, "cannot read manifest %s\n", manifest);
+        return 1;
+    }
+    if (suite ? (path_count != 0 || size == 0 || size > DECODE_WINDOW) : (path_count == 0 || (!batch && path_count != 1))) {
+        fprintf(stderr, "usage: %s [-threads <n> | -labels | -analyze [-8086] [-8088] | -exec [-quiet] [-8086] [-8088] [-biu] [-profile] [-accesses] [-record <trace>] [-until <point>] [-save <state>] [-resume] [-dump <memory>] [-image <pam> [-image-at <address>,<w>x<h>]] | -render] <file | ->\n"
+                        "       %s -batch [-threads <n>] [-outdir <dir>] [-manifest <list>] [-exec [-quiet] [-8086] [-8088] [-profile] [-accesses]] <file>...\n"
+                        "       %s -bench [-mix <kind>=<weight>,...] [-size <MB>]\n", argv[0], argv[0], argv[0]);
+        return 1;
+    }
+    if (options.record_path != NULL && (options.fast_forward || options.resume)) {
+        fprintf(stderr, "a recording has to start at the beginning of the program, it can't follow -until or -resume\n");
+        return 1;
+    }
+    if (options.record_path != NULL && options.biu) {
+        fprintf(stderr, "a recording keeps the manual's clocks only, it can't be made with -biu\n");
+        return 1;
+    }
+    if (batch && (options.record_path != NULL || options.save_path != NULL || options.dump_path != NULL || options.image_path != NULL)) {
+        fprintf(stderr, "-record, -save, -dump and -image name a single file, they can't be used with -batch\n");
+        return 1;
+    }
+
+    // build the op code dispatch table
+    init_decode_table();
+    init_length_table();
+
+    if (suite) {
+        int status = bench_suite(mix, size);
+        if (status != 0) {
+            fprintf(stderr, "bad mix %s, expected <kind>=<weight>,... with kinds reg, mem8, mem16, imm and jump\n", mix);
+        }
+        free(paths);
+        return (status != 0) ? 1 : 0;
+    }
+
+    if (options.threads <= 0) {
+        options.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (options.threads > MAX_THREADS) {
+        options.threads = MAX_THREADS;
+    }
+    // a profile is worth little without clocks, so it defaults to timing an 8086, as do the access
+    // counts, whose odd word accesses are what the clocks' penalties come from, and a fast-forward
+    // to a clock count, which would never get there untimed. The bus model matters most on the
+    // 8088, so it defaults to that
+    if (options.variants == 0 && options.biu) {
+        options.variants = CPU_8088;
+    }
+    if (options.variants == 0 && (options.profile || options.accesses || options.until.clocks != ~0ULL)) {
+        options.variants = CPU_8086;
+    }
+
+    int status = 0;
+    if (batch) {
+        status = run_batch(paths, path_count, &options, outdir);
+    } else {
+        // decoded instructions are formatted into one large buffer for stdout
+        struct output out;
+        output_init(&out, STDOUT_FILENO);
+        struct workspace workspace = {NULL, NULL};
+        status = process_file(&out, paths[0], options, &workspace);
+        output_flush(&out);
+        free(out.data);
+        if (workspace.cpu != NULL) {
+            cpu_free(workspace.cpu);
+            free(workspace.cpu);
+        }
+        free(workspace.program);
+    }
+
+    for (size_t k = listed; k < path_count; k++) {
+        free(paths[k]);
+    }
+    free(paths);
+    return status;
+}
+
+// disassembles, simulates or renders one input into out. The workspace buffers are allocated on
+// first use and kept for the next input
+int process_file(struct output *out, const char *path, struct options options, struct workspace *workspace) {
+    // open file in read mode
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return 1;
+    }
+    int result = 0;
+
+    if (options.exec) {
+        if (workspace->program == NULL) {
+            workspace->program = malloc(MEMORY_SIZE);
+            workspace->cpu = malloc(sizeof(struct cpu));
+            assert(workspace->program != NULL && workspace->cpu != NULL);
+            cpu_init(workspace->cpu);
+        }
+        // a machine state file stands in for the program, run_program() restores it for every run
+        int program_size = 0;
+        struct stat st;
+        if (options.resume) {
+            int status = fstat(fd, &st);
+            assert(status == 0);
+            options.snapshot = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (options.snapshot == MAP_FAILED || st.st_size < SNAPSHOT_HEADER + MEMORY_PAGES || memcmp(options.snapshot, SNAPSHOT_MAGIC, 4) != 0) {
+                fprintf(stderr, "%s is not a machine state file\n", path);
+                if (options.snapshot != MAP_FAILED) {
+                    munmap((void *)options.snapshot, st.st_size);
+                }
+                close(fd);
+                return 1;
+            }
+            options.snapshot_size = st.st_size;
+        } else {
+            program_size = load_program(fd, workspace->program);
+            assert(program_size >= 0);
+        }
+
+        // the trace is written through its own buffer, which is flushed in large blocks as it fills
+        struct output record;
+        if (options.record_path != NULL) {
+            int record_fd = open(options.record_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (record_fd < 0) {
+                fprintf(stderr, "cannot create %s\n", options.record_path);
+                if (options.resume) {
+                    munmap((void *)options.snapshot, options.snapshot_size);
+                }
+                close(fd);
+                return 1;
+            }
+            output_init(&record, record_fd);
+            output_string(&record, TRACE_MAGIC);
+            options.record = &record;
+        }
+
+        // with both processors each run gets a banner, like the tests/*.txt files have
+        byte variants = options.variants;
+        if (variants == 0) {
+            run_program(out, path, workspace->program, program_size, &options, workspace->cpu);
+        }
+        if (variants & CPU_8086) {
+            options.variant = CPU_8086;
+            run_program(out, path, workspace->program, program_size, &options, workspace->cpu);
+        }
+        if (variants & CPU_8088) {
+            options.variant = CPU_8088;
+            run_program(out, path, workspace->program, program_size, &options, workspace->cpu);
+        }
+
+        if (options.record_path != NULL) {
+            output_flush(&record);
+            close(record.fd);
+            free(record.data);
+        }
+        if (options.resume) {
+            munmap((void *)options.snapshot, options.snapshot_size);
+        }
+    } else if (options.render) {
+        struct stat st;
+        byte *trace = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            trace = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        if (trace == MAP_FAILED || render_trace(out, trace, st.st_size) != 0) {
+            fprintf(stderr, "%s is not a valid binary trace\n", path);
+            result = 1;
+        }
+        if (trace != MAP_FAILED) {
+            munmap(trace, st.st_size);
+        }
+    } else {
+        // regular files are mapped and decoded in place, anything else is streamed in chunks
+        struct stat st;
+        byte *image = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+
+        if (image != MAP_FAILED) {
+            madvise(image, st.st_size, MADV_SEQUENTIAL);
+            if (options.labels) {
+                decode_labeled(image, st.st_size, out);
+            } else if (options.analyze) {
+                if (options.variants == 0 || (options.variants & CPU_8086)) {
+                    analyze(image, st.st_size, CPU_8086, out);
+                }
+                if (options.variants & CPU_8088) {
+                    analyze(image, st.st_size, CPU_8088, out);
+                }
+            } else {
+                decode_mapped(image, st.st_size, options.threads, out);
+            }
+            munmap(image, st.st_size);
+        } else {
+            decode_stream(fd, out);
+        }
+    }
+
+    // close file
+    close(fd);
+    return result;
+}
+
+// processes every path on a pool of worker threads. Each worker starts out owning an even share
+// of the jobs and steals from the others once its own run out, so one slow input does not hold
+// up the rest. Results go to <outdir>/<n>-<name>.txt, n counting the paths from 1, or else to stdout in the order of the paths,
+// each after a "; <path>" line. Returns 1 if any input failed, 0 otherwise
+int run_batch(char *paths[], size_t count, const struct options *options, const char *outdir) {
+    struct batch batch = {.count = count, .options = options, .outdir = outdir, .spares = 0};
+    batch.jobs = calloc(count, sizeof(struct batch_job));
+    assert(batch.jobs != NULL);
+    for (size_t k = 0; k < count; k++) {
+        batch.jobs[k].path = paths[k];
+    }
+    batch.workers = (options->threads < (int)count) ? options->threads : (int)count;
+    for (int w = 0; w < batch.workers; w++) {
+        pthread_mutex_init(&batch.queues[w].lock, NULL);
+        batch.queues[w].head = count * w / batch.workers;
+        batch.queues[w].tail = count * (w + 1) / batch.workers;
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.finished, NULL);
+
+    pthread_t threads[MAX_THREADS];
+    struct batch_worker_args args[MAX_THREADS];
+    for (int w = 0; w < batch.workers; w++) {
+        args[w].batch = &batch;
+        args[w].worker = w;
+        int error = pthread_create(&threads[w], NULL, batch_worker, &args[w]);
+        assert(error == 0);
+    }
+
+    // results are written in order as soon as each one and all before it are finished
+    if (outdir == NULL) {
+        for (size_t k = 0; k < count; k++) {
+            struct batch_job *job = &batch.jobs[k];
+            pthread_mutex_lock(&batch.lock);
+            while (!job->done) {
+                pthread_cond_wait(&batch.finished, &batch.lock);
+            }
+            pthread_mutex_unlock(&batch.lock);
+
+            write_all(STDOUT_FILENO, job->result.data, job->result.used);
+
+            pthread_mutex_lock(&batch.lock);
+            if (batch.spares < MAX_THREADS * 2) {
+                job->result.used = 0;
+                batch.spare[batch.spares++] = job->result;
+            } else {
+                free(job->result.data);
+            }
+            pthread_mutex_unlock(&batch.lock);
+        }
+    }
+
+    for (int w = 0; w < batch.workers; w++) {
+        pthread_join(threads[w], NULL);
+        pthread_mutex_destroy(&batch.queues[w].lock);
+    }
+    for (int k = 0; k < batch.spares; k++) {
+        free(batch.spare[k].data);
+    }
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.finished);
+    int failed = 0;
+    for (size_t k = 0; k < count; k++) {
+        failed |= batch.jobs[k].failed;
+    }
+    free(batch.jobs);
+    return failed;
+}
+
+void *batch_worker(void *arg) {
+    struct batch *batch = ((struct batch_worker_args *)arg)->batch;
+    int worker = ((struct batch_worker_args *)arg)->worker;
+    struct workspace workspace = {NULL, NULL};
+
+    // with an output directory one buffer is pointed at each result file in turn
+    struct output file;
+    if (batch->outdir != NULL) {
+        output_init(&file, -1);
+    }
+
+    size_t k;
+    while ((k = take_job(batch, worker)) != SIZE_MAX) {
+        struct batch_job *job = &batch->jobs[k];
+
+        if (batch->outdir != NULL) {
+            // inputs from different directories can share a name, so the position keeps them apart
+            const char *name = strrchr(job->path, '/');
+            name = (name != NULL) ? name + 1 : job->path;
+            char result_path[strlen(batch->outdir) + strlen(name) + 28];
+            sprintf(result_path, "%s/%zu-%s.txt", batch->outdir, k + 1, name);
+            file.fd = open(result_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (file.fd < 0) {
+                fprintf(stderr, "cannot create %s\n", result_path);
+                job->failed = 1;
+                continue;
+            }
+            job->failed = process_file(&file, job->path, *batch->options, &workspace);
+            output_flush(&file);
+            close(file.fd);
+            continue;
+        }
+
+        pthread_mutex_lock(&batch->lock);
+        if (batch->spares > 0) {
+            job->result = batch->spare[--batch->spares];
+        } else {
+            output_init(&job->result, -1);
+        }
+        pthread_mutex_unlock(&batch->lock);
+
+        output_reserve(&job->result);
+        output_string(&job->result, "; ");
+        output_string(&job->result, job->path);
+        job->result.data[job->result.used++] = '\n';
+        job->failed = process_file(&job->result, job->path, *batch->options, &workspace);
+
+        pthread_mutex_lock(&batch->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&batch->finished);
+        pthread_mutex_unlock(&batch->lock);
+    }
+
+    if (batch->outdir != NULL) {
+        free(file.data);
+    }
+    if (workspace.cpu != NULL) {
+        cpu_free(workspace.cpu);
+        free(workspace.cpu);
+    }
+    free(workspace.program);
+    return NULL;
+}
+
+// the next job for a worker: its own next one, or else one stolen from the end of another
+// worker's queue. SIZE_MAX once every queue is empty
+size_t take_job(struct batch *batch, int worker) {
+    for (int n = 0; n < batch->workers; n++) {
+        struct job_queue *queue = &batch->queues[(worker + n) % batch->workers];
+        size_t k = SIZE_MAX;
+        pthread_mutex_lock(&queue->lock);
+        if (queue->head < queue->tail) {
+            k = (n == 0) ? queue->head++ : --queue->tail;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        if (k != SIZE_MAX) {
+            return k;
+        }
+    }
+    return SIZE_MAX;
+}
+
+// appends the non-empty lines of a manifest to paths, returns -1 if it cannot be read. Each line
+// is a copy of its own, for the caller to free along with paths
+int read_manifest(const char *manifest, char ***paths, size_t *count) {
+    FILE *file = fopen(manifest, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    size_t capacity = *count + 64;
+    *paths = realloc(*paths, capacity * sizeof(char *));
+    assert(*paths != NULL);
+
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    while ((length = getline(&line, &line_size, file)) >= 0) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if (length == 0) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity *= 2;
+            *paths = realloc(*paths, capacity * sizeof(char *));
+            assert(*paths != NULL);
+        }
+        (*paths)[(*count)++] = strdup(line);
+    }
+    free(line);
+    fclose(file);
+    return 0;
+}
+
+// decodes a memory mapped file in place, with several threads when asked to. Only the last few
+// bytes, where an instruction could run past the end of the mapping, are copied into a zero
+// padded buffer first
+void decode_mapped(const byte image[], size_t size, int threads, struct output *out) {
+    size_t i = 0;
+    if (threads > 1 && size > MAX_INSTRUCTION_LENGTH) {
+        i = decode_parallel(image, size - MAX_INSTRUCTION_LENGTH, threads, out);
+    }
+
+    while (size - i > MAX_INSTRUCTION_LENGTH) {
+        size_t window = size - i - MAX_INSTRUCTION_LENGTH;
+        i += decode(image + i, window < DECODE_WINDOW ? window : DECODE_WINDOW, out);
+    }
+
+    byte tail[2 * MAX_INSTRUCTION_LENGTH] = {0};
+    memcpy(tail, image + i, size - i);
+    decode(tail, size - i, out);
+}
+
+// decodes the instructions starting before size, a round of threads chunks at a time, and returns
+// where the last one ends. Each thread decodes its chunk into memory, starting at the chunk's
+// first byte as if an instruction began there. Variable length instructions resynchronize within
+// a few bytes, so the true stream coming from the previous chunk soon lands on an instruction the
+// thread decoded too, and from there the thread's output is the serial output. Chunks are stitched
+// together in order; one where the streams do not meet within SYNC_WINDOW is decoded again serially
+size_t decode_parallel(const byte image[], size_t size, int threads, struct output *out) {
+    struct decode_job *jobs = calloc(threads, sizeof(struct decode_job));
+    pthread_t workers[MAX_THREADS];
+    assert(jobs != NULL);
+    for (int t = 0; t < threads; t++) {
+        output_init(&jobs[t].out, -1);
+        jobs[t].image = image;
+    }
+
+    size_t i = 0;
+    while (i < size) {
+        // the first chunk of a round starts at the true stream, the others guess
+        int started = 0;
+        for (size_t start = i; start < size && started < threads; started++) {
+            struct decode_job *job = &jobs[started];
+            job->start = start;
+            job->end = (size - start > PARALLEL_CHUNK) ? start + PARALLEL_CHUNK : size;
+            start = job->end;
+            int error = pthread_create(&workers[started], NULL, decode_chunk, job);
+            assert(error == 0);
+        }
+
+        for (int t = 0; t < started; t++) {
+            struct decode_job *job = &jobs[t];
+            pthread_join(workers[t], NULL);
+
+            size_t offset = i - job->start;
+            if (offset < SYNC_WINDOW && job->sync[offset] != SIZE_MAX) {
+                output_bytes(out, job->out.data + job->sync[offset], job->out.used - job->sync[offset]);
+                i = job->landing;
+            } else {
+                i += decode(image + i, job->end - i, out);
+            }
+        }
+    }
+
+    for (int t = 0; t < threads; t++) {
+        free(jobs[t].out.data);
+    }
+    free(jobs);
+    return i;
+}
+
+// decodes one chunk for decode_parallel(), the instructions near its start one at a time so the
+// output can be cut at any of them
+void *decode_chunk(void *arg) {
+    struct decode_job *job = arg;
+    size_t i = job->start;
+    job->out.used = 0;
+    memset(job->sync, 0xff, sizeof(job->sync));
+
+    while (i < job->end && i - job->start < SYNC_WINDOW) {
+        job->sync[i - job->start] = job->out.used;
+        i += decode(job->image + i, 1, &job->out);
+    }
+    if (i < job->end) {
+        i += decode(job->image + i, job->end - i, &job->out);
+    }
+    job->landing = i;
+    return NULL;
+}
+
+// decodes input that cannot be mapped (pipes, stdin) in fixed size chunks. Instructions that are
+// split across a chunk boundary are carried over to the front of the buffer for the next read
+void decode_stream(int fd, struct output *out) {
+    byte buffer[CHUNK_SIZE + MAX_INSTRUCTION_LENGTH];
+    size_t filled = 0;
+
+    for (;;) {
+        ssize_t bytes_read = read(fd, buffer + filled, CHUNK_SIZE - filled);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        assert(bytes_read >= 0);
+        if (bytes_read == 0) {
+            break;
+        }
+        filled += bytes_read;
+
+        // only decode instructions that are guaranteed to lie entirely within the buffer
+        if (filled > MAX_INSTRUCTION_LENGTH) {
+            size_t used = decode(buffer, filled - MAX_INSTRUCTION_LENGTH, out);
+            memmove(buffer, buffer + used, filled - used);
+            filled -= used;
+        }
+    }
+
+    // whatever is left is the end of the input, pad it so the last instruction can't read garbage
+    memset(buffer + filled, 0, MAX_INSTRUCTION_LENGTH);
+    decode(buffer, filled, out);
+}
+
+// decodes every instruction that starts before n by dispatching each op code through the
+// decode table, and formats it into out. The caller must make sure the bytes of the last
+// instruction are readable, returns the offset just past the last decoded instruction
+size_t decode(const byte buffer[], size_t n, struct output *out) {
+    unsigned i = 0;
+    struct instruction inst;
+
+    while (i < n) {
+        const struct opcode *entry = &decode_table[buffer[i]];
+        memset(&inst, 0, sizeof(inst));
+        unsigned next = entry->decoder(buffer, i, entry->op, entry->w, &inst);
+        inst.size = next - i;
+        i = next;
+
+        output_reserve(out);
+        format_instruction(out, &inst);
+        out->data[out->used++] = '\n';
+    }
+
+    return i;
+}
+
+// disassembles a mapped file with a label_<offset> line in front of every instruction a jump, call
+// or loop goes to, and the label in place of the $+offset at the jump. The first pass only walks
+// the instruction lengths, marking where instructions start and where jumps go, so the second pass
+// knows every label before it formats anything. Targets inside an instruction or outside the file
+// keep the $+offset form. The output starts with bits 16 so nasm reassembles it. Where nasm
+// would pick a shorter encoding than the file has, for a displacement, an arithmetic immediate
+// or a near jmp, the operand says which (OPERAND_EXACT), so the bytes come back the same. The
+// encodings nasm has no way to ask for, such as a register to register operation with the d bit
+// set or 81 /0 on ax, come back as the equivalent encoding nasm picks
+void decode_labeled(const byte image[], size_t size, struct output *out) {
+    byte *starts = calloc(size / 8 + 1, 1);
+    byte *targets = calloc(size / 8 + 1, 1);
+    assert(starts != NULL && targets != NULL);
+
+    // the last few bytes are read from a zero padded copy, as decode_mapped() does
+    size_t body = (size > MAX_INSTRUCTION_LENGTH) ? size - MAX_INSTRUCTION_LENGTH : 0;
+    byte tail[2 * MAX_INSTRUCTION_LENGTH] = {0};
+    memcpy(tail, image + body, size - body);
+
+    size_t i = mark_targets(image, 0, 0, body, size, starts, targets);
+    mark_targets(tail, body, i, size, size, starts, targets);
+
+    output_reserve(out);
+    output_string(out, "bits 16\n");
+    i = decode_with_labels(image, 0, 0, body, size, starts, targets, out);
+    decode_with_labels(tail, body, i, size, size, starts, targets, out);
+
+    free(starts);
+    free(targets);
+}
+
+// first pass of decode_labeled() over the instructions starting in [i, end), where buffer[0] is
+// the byte at offset origin of the file. Returns where the last one ends
+size_t mark_targets(const byte buffer[], size_t origin, size_t i, size_t end, size_t size, byte starts[], byte targets[]) {
+    struct instruction inst;
+    while (i < end) {
+        starts[i >> 3] |= 1 << (i & 7);
+        const byte *code = buffer + (i - origin);
+        const struct opcode *entry = &decode_table[code[0]];
+        byte length = length_table[code[0]];
+        if (length & 0x80) {
+            length = (length & 0x7f) + ((code[1] >> 6 == 0b01) ? 1 : (code[1] >> 6 == 0b10 || (code[1] & 0b11000111) == 0b00000110) ? 2 : 0);
+        }
+
+        // short and near jumps are read straight from their bytes, only op codes without a
+        // length in the table are decoded, in case a prefix hides a jump behind them
+        size_t target = SIZE_MAX;
+        if (entry->decoder == decode_jump) {
+            target = i + 2 + (signed char)code[1];
+        } else if (entry->decoder == decode_near) {
+            target = i + 3 + (short)(code[1] | (code[2] << 8));
+        } else if (length == 0) {
+            memset(&inst, 0, sizeof(inst));
+            length = entry->decoder(code, 0, entry->op, entry->w, &inst);
+            if (inst.dest.type == OPERAND_RELATIVE) {
+                target = i + length + (short)inst.dest.value;
+            }
+        }
+        if (target < size) {
+            targets[target >> 3] |= 1 << (target & 7);
+        }
+        i += length;
+    }
+    return i;
+}
+
+// second pass of decode_labeled(), decode() with labels over the same range mark_targets() walked
+size_t decode_with_labels(const byte buffer[], size_t origin, size_t i, size_t end, size_t size, const byte starts[], const byte targets[], struct output *out) {
+    struct instruction inst;
+    while (i < end) {
+        if (targets[i >> 3] & (1 << (i & 7))) {
+            output_reserve(out);
+            output_string(out, "label_");
+            output_unsigned(out, i);
+            output_string(out, ":\n");
+        }
+
+        const struct opcode *entry = &decode_table[buffer[i - origin]];
+        memset(&inst, 0, sizeof(inst));
+        unsigned next = entry->decoder(buffer, i - origin, entry->op, entry->w, &inst);
+        inst.size = next - (i - origin);
+
+        output_reserve(out);
+        inst.dest.flags |= OPERAND_EXACT;
+        inst.source.flags |= OPERAND_EXACT;
+        size_t target = i + inst.size + (short)inst.dest.value;
+        if (inst.dest.type == OPERAND_RELATIVE && target < size && (starts[target >> 3] & targets[target >> 3] & (1 << (target & 7)))) {
+            inst.dest.type = OPERAND_NONE;
+            format_instruction(out, &inst);
+            // nasm makes a jmp short wherever it can, a near one that could have been short has to say so
+            int distance = (int)(target - (i + 2));
+            output_string(out, (inst.op == JMP && inst.size == 3 && distance >= -128 && distance < 128) ? " near label_" : " label_");
+            output_unsigned(out, target);
+        } else {
+            format_instruction(out, &inst);
+        }
+        out->data[out->used++] = '\n';
+        i += inst.size;
+    }
+    return i;
+}
+
+// costs a mapped file without running it, in one pass whatever its size. The instructions are cut
+// into basic blocks after every jump, call, return and interrupt and in front of the targets of
+// jumps forward, and every block is costed by adding up the base and effective address clocks of
+// its instructions, estimated as the simulation does on a machine whose registers are all 0:
+// conditional jumps not taken, repeated string instructions repeating once and shifts by cl not
+// shifting. A jump back to an instruction the pass went by makes a loop, costed from that
+// instruction to the jump with the jump taken. A loop back into the current block splits it there
+void analyze(const byte image[], size_t size, byte variant, struct output *out) {
+    struct analysis state;
+    memset(&state, 0, sizeof(state));
+    state.cpu.variant = variant;
+    state.window = malloc(ANALYSIS_WINDOW * sizeof(struct analysis_entry));
+    state.pending = calloc(ANALYSIS_WINDOW / 8, 1);
+    assert(state.window != NULL && state.pending != NULL);
+    for (size_t k = 0; k < ANALYSIS_WINDOW; k++) {
+        state.window[k].offset = SIZE_MAX;
+    }
+
+    // the last few bytes are read from a zero padded copy, as decode_mapped() does
+    byte tail[2 * MAX_INSTRUCTION_LENGTH] = {0};
+    state.body = (size > MAX_INSTRUCTION_LENGTH) ? size - MAX_INSTRUCTION_LENGTH : 0;
+    memcpy(tail, image + state.body, size - state.body);
+    state.image = image;
+    state.tail = tail;
+
+    output_reserve(out);
+    output_string(out, "Static analysis of ");
+    output_unsigned(out, size);
+    output_string(out, (variant == CPU_8088) ? " bytes: clocks on the 8088, per iteration for loops\n\n" : " bytes: clocks on the 8086, per iteration for loops\n\n");
+    output_string(out, "      clocks  instructions  block\n");
+
+    size_t i = analyze_range(&state, image, 0, 0, state.body, size, out);
+    i = analyze_range(&state, tail, state.body, i, size, size, out);
+    if (state.block != i) {
+        end_block(&state, i, state.last, state.clocks, state.count, out);
+    }
+
+    output_reserve(out);
+    output_string(out, "\n");
+    output_unsigned(out, state.count);
+    output_string(out, " instructions in ");
+    output_unsigned(out, state.blocks);
+    output_string(out, " blocks with ");
+    output_unsigned(out, state.loops);
+    output_string(out, " loops, ");
+    output_unsigned(out, state.clocks);
+    output_string(out, " clocks straight through\n");
+
+    free(state.window);
+    free(state.pending);
+}
+
+// the pass of analyze() over the instructions starting in [i, end), where buffer[0] is the byte
+// at offset origin of the file. Returns where the last one ends
+size_t analyze_range(struct analysis *state, const byte buffer[], size_t origin, size_t i, size_t end, size_t size, struct output *out) {
+    const size_t mask = ANALYSIS_WINDOW - 1;
+    struct instruction inst;
+    struct timing timing;
+    while (i < end) {
+        if ((state->pending[(i & mask) >> 3] & (1 << (i & 7))) && state->block != i) {
+            end_block(state, i, state->last, state->clocks, state->count, out);
+        }
+
+        const byte *code = buffer + (i - origin);
+        const struct opcode *entry = &decode_table[code[0]];
+        memset(&inst, 0, sizeof(inst));
+        inst.size = entry->decoder(code, 0, entry->op, entry->w, &inst);
+        for (size_t k = i; k < i + inst.size; k++) {
+            state->pending[(k & mask) >> 3] &= ~(1 << (k & 7));
+        }
+        state->window[i & mask] = (struct analysis_entry) {i, state->last, state->clocks, state->count};
+        state->last = i;
+
+        estimate_clocks(&state->cpu, &inst, &timing);
+        settle_clocks(&state->cpu, &inst, 0, 1, &timing);
+        unsigned clocks = timing.base + timing.ea + timing.penalty;
+
+        size_t target = i + inst.size + (short)inst.dest.value;
+        if (inst.dest.type == OPERAND_RELATIVE && target > i && target < size) {
+            state->pending[(target & mask) >> 3] |= 1 << (target & 7);
+        } else if (inst.dest.type == OPERAND_RELATIVE && target <= i && (inst.op == JUMP || inst.op == JMP) &&
+                   state->window[target & mask].offset == target) {
+            const struct analysis_entry *head = &state->window[target & mask];
+            if (target > state->block) {
+                end_block(state, target, head->previous, head->clocks, head->count, out);
+            }
+            settle_clocks(&state->cpu, &inst, 1, 1, &timing);
+            state->clocks += clocks;
+            state->count++;
+            end_block(state, i + inst.size, i, state->clocks, state->count, out);
+            analysis_row(state, target, i, state->clocks - clocks + timing.base - head->clocks, state->count - head->count, "loop of ", out);
+            state->loops++;
+            i += inst.size;
+            continue;
+        }
+
+        state->clocks += clocks;
+        state->count++;
+        if (operations[inst.op].flags & (OP_TRANSFER | OP_STOP)) {
+            end_block(state, i + inst.size, i, state->clocks, state->count, out);
+        }
+        i += inst.size;
+    }
+    return i;
+}
+
+// prints the block from the current one's start up to the instruction at last, given the clocks
+// and count as of the end of it, and starts the next block at end
+void end_block(struct analysis *state, size_t end, size_t last, unsigned long long clocks, unsigned long long count, struct output *out) {
+    analysis_row(state, state->block, last, clocks - state->block_clocks, count - state->block_count, "", out);
+    state->block = end;
+    state->block_clocks = clocks;
+    state->block_count = count;
+    state->blocks++;
+}
+
+// one row of the -analyze table, a block or loop from start to the instruction at last, which is
+// decoded again to show how it ends
+void analysis_row(struct analysis *state, size_t start, size_t last, unsigned long long clocks, unsigned long long count, const char *note, struct output *out) {
+    const byte *code = (last < state->body) ? state->image + last : state->tail + (last - state->body);
+    const struct opcode *entry = &decode_table[code[0]];
+    struct instruction inst;
+    memset(&inst, 0, sizeof(inst));
+    inst.size = entry->decoder(code, 0, entry->op, entry->w, &inst);
+
+    output_reserve(out);
+    output_padded(out, clocks, 12);
+    output_padded(out, count, 14);
+    output_string(out, "  ");
+    output_hex(out, start, 4);
+    out->data[out->used++] = '-';
+    output_hex(out, last, 4);
+    output_string(out, "  ");
+    output_string(out, note);
+    format_instruction(out, &inst);
+    out->data[out->used++] = '\n';
+}
+
+// compiles the encodings table into the dispatch tables, so that decode() pays one lookup per
+// instruction however many op codes there are, and two for the op codes of a group. Every first
+// byte no row matches, and every reg field a group leaves out, decodes to a DB of that byte
+void init_decode_table(void) {
+    int groups = 0;
+    for (unsigned b = 0; b < 256; b++) {
+        struct opcode *entry = &decode_table[b];
+        entry->decoder = decode_unknown;
+        entry->op = DB;
+        entry->w = 0;
+
+        for (size_t r = 0; r < sizeof(encodings) / sizeof(encodings[0]); r++) {
+            const struct encoding *row = &encodings[r];
+            if (!match_pattern(row->pattern, b)) {
+                continue;
+            }
+            const char *w_bit = strchr(row->pattern, 'w');
+            byte w = (w_bit != NULL) ? (b >> (7 - (w_bit - row->pattern))) & 1 : 1;
+
+            if (row->group == NO_GROUP) {
+                if (entry->decoder == decode_unknown) {
+                    *entry = (struct opcode) {row->decoder, row->op, w};
+                }
+                continue;
+            }
+            if (entry->decoder == decode_unknown) {
+                assert(groups < MAX_GROUPS);
+                *entry = (struct opcode) {decode_group, groups++, w};
+                for (int reg = 0; reg < 8; reg++) {
+                    group_table[entry->op][reg] = (struct opcode) {decode_unknown, DB, 0};
+                }
+            }
+            if (entry->decoder == decode_group && group_table[entry->op][row->group].decoder == decode_unknown) {
+                group_table[entry->op][row->group] = (struct opcode) {row->decoder, row->op, w};
+            }
+        }
+    }
+}
+
+// whether byte b has the fixed bits of an encoding pattern
+int match_pattern(const char *pattern, byte b) {
+    for (int bit = 0; bit < 8; bit++) {
+        byte value = (b >> (7 - bit)) & 1;
+        if ((pattern[bit] == '0' && value != 0) || (pattern[bit] == '1' && value != 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// fills length_table by running every op code's decoder on a register form and on a form with
+// a one byte displacement, then checks the rule against all second bytes so an op code the rule
+// does not fit falls back to its decoder
+void init_length_table(void) {
+    static const byte displacement[4] = {0, 1, 2, 0};   // by mod, mod 00 with rm 110 adds 2 too
+    byte buffer[2 * MAX_INSTRUCTION_LENGTH] = {0};
+    struct instruction inst;
+
+    for (unsigned b = 0; b < 256; b++) {
+        const struct opcode *entry = &decode_table[b];
+        buffer[0] = b;
+        buffer[1] = 0b11000000;
+        unsigned base = entry->decoder(buffer, 0, entry->op, entry->w, &inst);
+        buffer[1] = 0b01000000;
+        int modrm = entry->decoder(buffer, 0, entry->op, entry->w, &inst) != base;
+        length_table[b] = base | (modrm << 7);
+
+        for (unsigned second = 0; second < 256; second++) {
+            buffer[1] = second;
+            unsigned expected = base;
+            if (modrm) {
+                expected += (second >> 6 == 0b00 && (second & 0b111) == 0b110) ? 2 : displacement[second >> 6];
+            }
+            if (entry->decoder(buffer, 0, entry->op, entry->w, &inst) != expected) {
+                length_table[b] = 0;
+                break;
+            }
+        }
+    }
+}
+
+double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// times decoding, formatting and simulating synthetic instruction streams, every corpus of
+// bench_mixes or only the one mix describes. Prints one CSV line per corpus and stage so runs of
+// different versions can be compared by a script. Returns -1 if mix can't be parsed
+int bench_suite(const char *mix, size_t size) {
+    struct corpus_mix custom;
+    if (mix != NULL && parse_mix(mix, &custom) != 0) {
+        return -1;
+    }
+
+    printf("corpus,stage,bytes,instructions,seconds,mb_per_s,instructions_per_s,cycles_per_instruction\n");
+    if (mix != NULL) {
+        bench_corpus(&custom, size);
+        return 0;
+    }
+    for (size_t k = 0; k < sizeof(bench_mixes) / sizeof(bench_mixes[0]); k++) {
+        bench_corpus(&bench_mixes[k], size);
+    }
+    return 0;
+}
+
+// the stages of one corpus, each the best of BENCH_ROUNDS runs. decode only fills instruction
+// records, format also turns them into text in memory. The simulation stages run the first
+// BENCH_PROGRAM_SIZE bytes of the corpus as a program, untimed and timed for an 8086, from the
+// same state every round; their counts are the instructions that executed, not the ones in the code
+void bench_corpus(const struct corpus_mix *mix, size_t size) {
+    byte *corpus = malloc(size + MAX_INSTRUCTION_LENGTH);
+    assert(corpus != NULL);
+    unsigned long long instructions;
+    size_t n = generate_corpus(corpus, size, mix, 1, &instructions);
+
+    struct output out;
+    output_init(&out, -1);
+    for (int stage = 0; stage < 2; stage++) {
+        double best = 0;
+        unsigned long long best_cycles = 0;
+        for (int round = 0; round < BENCH_ROUNDS; round++) {
+            out.used = 0;
+            double start = seconds();
+            unsigned long long cycles = __rdtsc();
+            if (stage == 0) {
+                unsigned long long decoded = decode_records(corpus, n);
+                assert(decoded == instructions);
+            } else {
+                decode(corpus, n, &out);
+            }
+            cycles = __rdtsc() - cycles;
+            double end = seconds();
+            if (round == 0 || end - start < best) {
+                best = end - start;
+                best_cycles = cycles;
+            }
+        }
+        bench_report(mix->name, (stage == 0) ? "decode" : "format", n, instructions, best, best_cycles);
+    }
+    free(out.data);
+
+    // one profiled run counts what executes, which is the same in every round
+    struct cpu cpu;
+    cpu_init(&cpu);
+    size_t program_size = generate_corpus(cpu.memory, BENCH_PROGRAM_SIZE, mix, 1, &instructions);
+    cpu.profile = calloc(0x10000, sizeof(struct profile_entry));
+    assert(cpu.profile != NULL);
+    bench_reset(&cpu);
+    cpu.variant = CPU_8086;
+    run_loops[RUN_CLOCKS | RUN_PROFILE](&cpu, program_size, NULL);
+    instructions = 0;
+    size_t bytes = 0;
+    for (unsigned ip = 0; ip < program_size; ip++) {
+        instructions += cpu.profile[ip].count;
+        bytes += cpu.profile[ip].count * cpu.decoded[ip].size;
+    }
+    free(cpu.profile);
+    cpu.profile = NULL;
+
+    for (int stage = 0; stage < 2; stage++) {
+        double best = 0;
+        unsigned long long best_cycles = 0;
+        cpu.variant = (stage == 0) ? 0 : CPU_8086;
+        for (int round = 0; round < BENCH_ROUNDS; round++) {
+            bench_reset(&cpu);
+            double start = seconds();
+            unsigned long long cycles = __rdtsc();
+            run_loops[(stage == 0) ? 0 : RUN_CLOCKS](&cpu, program_size, NULL);
+            cycles = __rdtsc() - cycles;
+            double end = seconds();
+            if (round == 0 || end - start < best) {
+                best = end - start;
+                best_cycles = cycles;
+            }
+        }
+        bench_report(mix->name, (stage == 0) ? "simulate" : "simulate-8086", bytes, instructions, best, best_cycles);
+    }
+    cpu_free(&cpu);
+    free(corpus);
+}
+
+// cycles are time stamp counter ticks of the host, not clocks of the simulated processor
+void bench_report(const char *corpus, const char *stage, size_t bytes, unsigned long long instructions, double best, unsigned long long cycles) {
+    printf("%s,%s,%zu,%llu,%.6f,%.1f,%.0f,%.2f\n", corpus, stage, bytes, instructions, best,
+           bytes / best / 1e6, instructions / best, (double)cycles / instructions);
+}
+
+// reads a mix like "reg=4,mem8=2,jump=1" into the corpus called custom, kinds left out don't
+// appear. Returns -1 for an unknown kind, a weight over 255, or a mix without any instructions
+int parse_mix(const char *spec, struct corpus_mix *mix) {
+    memset(mix, 0, sizeof(*mix));
+    mix->name = "custom";
+    int total = 0;
+    while (*spec != '\0') {
+        size_t length = strcspn(spec, "=");
+        int kind = 0;
+        while (kind < KIND_COUNT && (strlen(kind_names[kind]) != length || strncmp(spec, kind_names[kind], length) != 0)) {
+            kind++;
+        }
+        if (kind == KIND_COUNT || spec[length] != '=') {
+            return -1;
+        }
+        char *end;
+        long weight = strtol(spec + length + 1, &end, 10);
+        if (end == spec + length + 1 || weight < 0 || weight > 255 || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        mix->weights[kind] = weight;
+        total += weight;
+        spec = (*end == ',') ? end + 1 : end;
+    }
+    return (total > 0) ? 0 : -1;
+}
+
+// fills corpus with instructions drawn from the mix until the next one might not fit in size, and
+// zeroes the rest. The same seed always gives the same stream. Jumps skip up to two of the
+// instructions after them, so the stream decodes the same from its start and a run never loops.
+// Returns the bytes of instructions and their count in instructions
+size_t generate_corpus(byte corpus[], size_t size, const struct corpus_mix *mix, unsigned seed, unsigned long long *instructions) {
+    // jumps whose target isn't placed yet: where their displacement goes and how many instructions to skip
+    size_t pending[8];
+    int skips[8];
+    int waiting = 0;
+
+    int total = 0;
+    for (int kind = 0; kind < KIND_COUNT; kind++) {
+        total += mix->weights[kind];
+    }
+
+    unsigned state = seed;
+    size_t i = 0;
+    *instructions = 0;
+    while (i + MAX_INSTRUCTION_LENGTH <= size) {
+        for (int k = 0; k < waiting; k++) {
+            if (skips[k]-- == 0) {
+                corpus[pending[k]] = i - pending[k] - 1;
+                pending[k] = pending[--waiting];
+                skips[k--] = skips[waiting];
+            }
+        }
+
+        int pick = next_random(&state) % total, kind = 0;
+        while (pick >= mix->weights[kind]) {
+            pick -= mix->weights[kind++];
+        }
+        unsigned r = next_random(&state);
+        byte w = r & 1, reg = (r >> 1) & 0b111, rm = (r >> 4) & 0b111;
+        // mov or one of the eight ALU ops, in either direction
+        byte rm_op = ((r >> 7) % 9 == 8) ? 0b10001000 : ((r >> 7) % 9) << 3;
+        byte d = (r >> 11) & 0b10;
+
+        switch (kind) {
+            case KIND_REG:
+                corpus[i++] = rm_op | d | w;
+                corpus[i++] = 0b11000000 | (reg << 3) | rm;
+                break;
+            case KIND_MEM8:
+                corpus[i++] = rm_op | d | w;
+                corpus[i++] = 0b01000000 | (reg << 3) | rm;
+                corpus[i++] = r >> 16;
+                break;
+            case KIND_MEM16:
+                corpus[i++] = rm_op | d | w;
+                corpus[i++] = ((r >> 13) & 0b11) ? 0b10000000 | (reg << 3) | rm : (reg << 3) | 0b110;
+                corpus[i++] = r >> 16;
+                corpus[i++] = r >> 24;
+                break;
+            case KIND_IMM:
+                if ((r >> 13) & 1) {
+                    corpus[i++] = 0b10110000 | (w << 3) | reg;      // mov reg, imm
+                } else if ((r >> 14) & 1) {
+                    corpus[i++] = 0b10000000 | w;                   // ALU op reg, imm
+                    corpus[i++] = 0b11000000 | (rm_op & 0b00111000) | rm;
+                } else {
+                    corpus[i++] = (rm_op & 0b00111000) | 0b100 | w; // ALU op accumulator, imm
+                }
+                corpus[i++] = r >> 16;
+                if (w) {
+                    corpus[i++] = r >> 24;
+                }
+                break;
+            case KIND_JUMP:
+                corpus[i++] = ((r >> 13) % 8 == 0) ? 0b11101011 : 0b01110000 | ((r >> 16) & 0xf);
+                if (waiting < 8) {
+                    pending[waiting] = i;
+                    skips[waiting++] = (r >> 20) % 3;
+                }
+                corpus[i++] = 0;
+                break;
+        }
+        (*instructions)++;
+    }
+
+    // jumps still waiting go to the end of the stream
+    for (int k = 0; k < waiting; k++) {
+        corpus[pending[k]] = i - pending[k] - 1;
+    }
+    memset(corpus + i, 0, size + MAX_INSTRUCTION_LENGTH - i);
+    return i;
+}
+
+// xorshift, a deterministic stream for the corpora
+unsigned next_random(unsigned *state) {
+    unsigned x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// decode() without the formatting, returns the number of instructions
+unsigned long long decode_records(const byte buffer[], size_t n) {
+    unsigned long long count = 0;
+    unsigned i = 0;
+    struct instruction inst;
+
+    while (i < n) {
+        const struct opcode *entry = &decode_table[buffer[i]];
+        memset(&inst, 0, sizeof(inst));
+        unsigned next = entry->decoder(buffer, i, entry->op, entry->w, &inst);
+        inst.size = next - i;
+        i = next;
+        count++;
+    }
+
+    return count;
+}
+
+// puts a simulated corpus back at its start, with its data segment cleared. The predecoded
+// instructions and translated blocks are kept, as the corpus never stores into its code
+void bench_reset(struct cpu *cpu) {
+    memset(cpu->regs, 0, sizeof(cpu->regs));
+    cpu->regs[DS] = cpu->regs[ES] = cpu->regs[SS] = BENCH_DATA_SEGMENT;
+    cpu->ip = 0;
+    cpu->flags = 0;
+    cpu->lazy_op = NONE;
+    cpu->clocks = 0;
+    memset(cpu->memory + BENCH_DATA_SEGMENT * 16, 0, 0x10000 + 1);
+}
+
+// op codes of a group (1000 00sw, 1101 00vw, 1111 x11w and 1000 1111), the reg field of the
+// mod/rm byte picks the row of the group to decode with
+unsigned decode_group(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    (void)w;
+    const struct opcode *entry = &group_table[op][(buffer[i+1] >> 3) & 0b111];
+    return entry->decoder(buffer, i, entry->op, entry->w, inst);
+}
+
+// LOCK, REP, REPNE and segment override prefixes are decoded along with the instruction they
+// apply to. Up to two are taken, a prefix in front of more than that stands on its own
+unsigned decode_prefix(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    if (decode_table[buffer[i+1]].decoder == decode_prefix && decode_table[buffer[i+2]].decoder == decode_prefix) {
+        inst->op = op;
+        if (op == SEGMENT) {
+            return decode_unknown(buffer, i, op, w, inst);
+        }
+        return i + 1;
+    }
+
+    const struct opcode *entry = &decode_table[buffer[i+1]];
+    unsigned next = entry->decoder(buffer, i + 1, entry->op, entry->w, inst);
+    switch (op) {
+        case LOCK: inst->prefixes |= PREFIX_LOCK; break;
+        case REP: inst->prefixes |= PREFIX_REP; break;
+        case REPNE: inst->prefixes |= PREFIX_REPNE; break;
+        default: inst->prefixes |= PREFIX_SEGMENT | (buffer[i] & 0b11000) << 1; break;
+    }
+    return next;
+}
+
+// conditional jumps (0111 cccc) and loops (1110 00cc), the low bits of the op code select the
+// condition. Also the short JMP, which has none
+unsigned decode_jump(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    (void)w;
+    inst->op = op;
+    if (op == JUMP) {
+        inst->cond = ((buffer[i] >> 4) == 0b0111) ? (buffer[i] & 0b1111) : 16 + (buffer[i] & 0b11);
+    }
+    inst->dest.type = OPERAND_RELATIVE;
+    inst->dest.value = (signed char)buffer[i+1];
+    return i + 2;
+}
+
+// CALL and JMP direct within segment, 16-bit displacement
+unsigned decode_near(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    (void)w;
+    inst->op = op;
+    inst->dest.type = OPERAND_RELATIVE;
+    inst->dest.value = buffer[i+1] | (buffer[i+2] << 8);
+    return i + 3;
+}
+
+// CALL and JMP direct intersegment, offset then segment
+unsigned decode_far(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    inst->op = op;
+    inst->w = w;
+    inst->dest.type = OPERAND_FAR;
+    inst->dest.value = buffer[i+1] | (buffer[i+2] << 8);
+    inst->source.value = buffer[i+3] | (buffer[i+4] << 8);
+    return i + 5;
+}
+
+// a byte that isn't an op code the 8086 documents, kept as data
+unsigned decode_unknown(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    (void)op;
+    (void)w;
+    inst->op = DB;
+    inst->dest.type = OPERAND_IMMEDIATE;
+    inst->dest.value = buffer[i];
+    return i + 1;
+}
+
+// single byte instructions without operands, string instructions take their width from w
+unsigned decode_none(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    (void)buffer;
+    inst->op = op;
+    inst->w = w;
+    return i + 1;
+}
+
+// AAM and AAD, whose second byte is always 00001010
+unsigned decode_aam(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    (void)buffer;
+    (void)w;
+    inst->op = op;
+    return i + 2;
+}
+
+// INT with its type
+unsigned decode_data8(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    (void)w;
+    inst->op = op;
+    inst->dest.type = OPERAND_IMMEDIATE;
+    inst->dest.value = buffer[i+1];
+    return i + 2;
+}
+
+// RET and RETF with the bytes to pop after the return address
+unsigned decode_data16(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    (void)w;
+    inst->op = op;
+    inst->w = 1;
+    inst->dest.type = OPERAND_IMMEDIATE;
+    inst->dest.value = buffer[i+1] | (buffer[i+2] << 8);
+    return i + 3;
+}
+
+// MOV immediate to register
+unsigned decode_mov_im_to_reg(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    inst->op = op;
+    inst->w = w;
+    inst->dest.type = OPERAND_REGISTER;
+    inst->dest.reg = (w << 3) | (buffer[i] & 0b111);    // destination register field encoding
+    inst->source.type = OPERAND_IMMEDIATE;
+    i++;
+    if (w == 1) {
+        i++;
+        inst->source.value = buffer[i-1] | (buffer[i] << 8);    // 16 bits of data goes in register
+    } else {
+        inst->source.value = buffer[i];                         // 8 bits of data goes in register
+    }
+    return ++i;
+}
+
+// register/memory and register: MOV, XCHG, TEST and the arithmetic and logic operations
+unsigned decode_rm_reg(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    byte d, reg;
+    d = (buffer[i] >> 1) & 1;       // whether reg field is destination (1) or source (0)
+    i++;
+    reg = (buffer[i] >> 3) & 0b111; // register field encoding
+
+    inst->op = op;
+    inst->w = w;
+
+    struct operand *reg_operand = (d == 1) ? &inst->dest : &inst->source;
+    struct operand *rm_operand = (d == 1) ? &inst->source : &inst->dest;
+
+    reg_operand->type = OPERAND_REGISTER;
+    reg_operand->reg = (w << 3) | reg;
+
+    return decode_register_or_memory(buffer, i, w, rm_operand) + 1;
+}
+
+// a register/memory operand alone: INC, DEC, NEG, NOT, MUL, DIV, PUSH, POP and the indirect CALL and JMP
+unsigned decode_rm(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    inst->op = op;
+    inst->w = w;
+    return decode_register_or_memory(buffer, i + 1, w, &inst->dest) + 1;
+}
+
+// CALL and JMP indirect intersegment, through a far pointer in memory
+unsigned decode_rm_far(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    i = decode_rm(buffer, i, op, w, inst);
+    inst->dest.flags = OPERAND_POINTER;
+    return i;
+}
+
+// shifts and rotates (1101 00vw), by 1 or by cl
+unsigned decode_shift(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    byte v = (buffer[i] >> 1) & 1;
+    i = decode_rm(buffer, i, op, w, inst);
+    if (v == 1) {
+        inst->source.type = OPERAND_REGISTER;
+        inst->source.reg = CX;      // cl
+    } else {
+        inst->source.type = OPERAND_IMMEDIATE;
+        inst->source.value = 1;
+    }
+    return i;
+}
+
+// LEA, LDS and LES: a word register loaded from a memory operand
+unsigned decode_load_pointer(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    (void)w;
+    inst->op = op;
+    inst->w = 1;
+    inst->dest.type = OPERAND_REGISTER;
+    inst->dest.reg = (1 << 3) | ((buffer[i+1] >> 3) & 0b111);
+    return decode_register_or_memory(buffer, i + 1, 1, &inst->source) + 1;
+}
+
+// INC, DEC, PUSH and POP of the word register in the low bits of the op code
+unsigned decode_reg16(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    (void)w;
+    inst->op = op;
+    inst->w = 1;
+    inst->dest.type = OPERAND_REGISTER;
+    inst->dest.reg = (1 << 3) | (buffer[i] & 0b111);
+    return i + 1;
+}
+
+// XCHG register with accumulator
+unsigned decode_xchg_acc(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    i = decode_reg16(buffer, i, op, w, inst);
+    inst->source = inst->dest;
+    inst->dest.flags = OPERAND_ACCUMULATOR;
+    inst->dest.reg = 1 << 3;
+    return i;
+}
+
+// PUSH and POP segment register (000 sr 11x)
+unsigned decode_segment_register(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    (void)w;
+    inst->op = op;
+    inst->w = 1;
+    inst->dest.type = OPERAND_REGISTER;
+    inst->dest.reg = 16 + ((buffer[i] >> 3) & 0b11);
+    return i + 1;
+}
+
+// IN and OUT (1110 v1dw) with a fixed port, or with the port in dx when v is set
+unsigned decode_port(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    byte v = (buffer[i] >> 3) & 1;
+    inst->op = op;
+    inst->w = w;
+
+    struct operand *acc = (op == IN) ? &inst->dest : &inst->source;
+    struct operand *port = (op == IN) ? &inst->source : &inst->dest;
+    acc->type = OPERAND_REGISTER;
+    acc->flags = OPERAND_ACCUMULATOR;
+    acc->reg = w << 3;
+    if (v == 1) {
+        port->type = OPERAND_REGISTER;
+        port->reg = (1 << 3) | DX;
+        return i + 1;
+    }
+    port->type = OPERAND_IMMEDIATE;
+    port->value = buffer[i+1];
+    return i + 2;
+}
+
+// arithmetic and logic immediate with register/memory, sign extended when s is set
+unsigned decode_arithmetic_im_to_rm(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    byte s;
+    s = (buffer[i] >> 1) & 1;
+    i++;
+
+    inst->op = op;
+    inst->w = w;
+    i = decode_register_or_memory(buffer, i, w, &inst->dest);
+
+    inst->source.type = OPERAND_IMMEDIATE;
+    if (s == 1 && w == 1) {         // sign extend
+        inst->source.value = (signed char)buffer[++i];
+        inst->source.flags = OPERAND_SIGNED;
+    } else if (s == 0 && w == 1) {  // read word of data
+        i += 2;
+        inst->source.value = buffer[i-1] | (buffer[i] << 8);
+    } else {                        // read byte of data
+        inst->source.value = buffer[++i];
+    }
+
+    return ++i;
+}
+
+// immediate with accumulator: the arithmetic and logic operations and TEST
+unsigned decode_im_to_acc(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    inst->op = op;
+    inst->w = w;
+    inst->dest.type = OPERAND_REGISTER;
+    inst->dest.flags = OPERAND_ACCUMULATOR;
+    inst->dest.reg = w << 3;
+    inst->source.type = OPERAND_IMMEDIATE;
+
+    if (w == 1) {
+        i += 2;
+        inst->source.value = buffer[i-1] | (buffer[i] << 8);
+    } else {
+        inst->source.value = buffer[++i];
+    }
+
+    return ++i;
+}
+
+// MOV memory to accumulator
+unsigned decode_mov_mem_to_acc(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    inst->op = op;
+    inst->w = w;
+    inst->dest.type = OPERAND_REGISTER;
+    inst->dest.flags = OPERAND_ACCUMULATOR;
+    inst->dest.reg = w << 3;
+    return decode_effective_address(buffer, i, 0b110, 0b00, &inst->source) + 1;
+}
+
+// MOV accumulator to memory
+unsigned decode_mov_acc_to_mem(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    inst->op = op;
+    inst->w = w;
+    inst->source.type = OPERAND_REGISTER;
+    inst->source.flags = OPERAND_ACCUMULATOR;
+    inst->source.reg = w << 3;
+    return decode_effective_address(buffer, i, 0b110, 0b00, &inst->dest) + 1;
+}
+
+// MOV and TEST immediate to register/memory, the data is as wide as the operation
+unsigned decode_im_to_rm(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    inst->op = op;
+    inst->w = w;
+    i = decode_register_or_memory(buffer, i + 1, w, &inst->dest);
+
+    inst->source.type = OPERAND_IMMEDIATE;
+    if (w == 1) {
+        i += 2;
+        inst->source.value = buffer[i-1] | (buffer[i] << 8);
+    } else {
+        inst->source.value = buffer[++i];
+    }
+
+    return ++i;
+}
+
+// MOV register/memory to segment register (10001110) and segment register to register/memory (10001100)
+unsigned decode_mov_segment(const byte buffer[], unsigned i, byte op, byte w, struct instruction *inst) {
+    byte d, sr;
+    d = (buffer[i] >> 1) & 1;       // whether the segment register is the destination
+    i++;
+    sr = (buffer[i] >> 3) & 0b11;   // segment register field encoding
+
+    inst->op = op;
+    inst->w = w;
+
+    struct operand *sr_operand = (d == 1) ? &inst->dest : &inst->source;
+    struct operand *rm_operand = (d == 1) ? &inst->source : &inst->dest;
+
+    sr_operand->type = OPERAND_REGISTER;
+    sr_operand->reg = 16 + sr;
+
+    return decode_register_or_memory(buffer, i, 1, rm_operand) + 1;
+}
+
+// decodes the mod and rm fields of the mod/rm byte at i into a register or memory operand,
+// returns the index of its last byte
+unsigned decode_register_or_memory(const byte buffer[], unsigned i, byte w, struct operand *operand) {
+    byte mod = buffer[i] >> 6;      // mode field encoding
+    byte rm = buffer[i] & 0b111;    // register/memory field encoding
+
+    if (mod == 0b11) {              // register mode
+        operand->type = OPERAND_REGISTER;
+        operand->reg = (w << 3) | rm;
+        return i;
+    }
+    return decode_effective_address(buffer, i, rm, mod, operand);
+}
+
+// decodes the effective address based on rm and mod into a memory operand
+unsigned decode_effective_address(const byte buffer[], unsigned i, byte rm, byte mod, struct operand *operand) {
+    operand->type = OPERAND_MEMORY;
+    operand->reg = rm;
+    operand->mod = mod;
+
+    if (mod == 0b00) {          // no displacement (unless rm == 0b110, in which case 16-bit direct address)
+        if (rm == 0b110) {
+            i += 2;
+            operand->value = buffer[i-1] | (buffer[i] << 8);
+        }
+    } else if (mod == 0b01) {   // 8-bit displacement (sign extend to 16 bits, see page 4-20 of manual)
+        i++;
+        operand->value = (signed char)buffer[i];
+    } else if (mod == 0b10) {   // 16-bit displacement
+        i += 2;
+        operand->value = buffer[i-1] | (buffer[i] << 8);
+    }
+
+    return i;
+}
+
+// writes one decoded instruction as assembly in the syntax of the tests/*.txt traces, which nasm
+// also accepts. The caller makes room with output_reserve() and ends the line
+void format_instruction(struct output *out, const struct instruction *inst) {
+    if (inst->prefixes & PREFIX_LOCK) {
+        output_string(out, "lock ");
+    }
+    if (inst->prefixes & (PREFIX_REP | PREFIX_REPNE)) {
+        output_string(out, (inst->prefixes & PREFIX_REP) ? "rep " : "repne ");
+    }
+    // an override is written in front of the memory operand, or in front of the instruction when
+    // it has none, as the string instructions and xlat, whose memory isn't an operand
+    if ((inst->prefixes & PREFIX_SEGMENT) && inst->dest.type != OPERAND_MEMORY && inst->source.type != OPERAND_MEMORY) {
+        output_string(out, lookup_register(16 + ((inst->prefixes >> 4) & 0b11)));
+        out->data[out->used++] = ' ';
+    }
+    output_string(out, (inst->op == JUMP) ? jump_names[inst->cond] : operations[inst->op].name);
+    if (operations[inst->op].flags & OP_STRING) {
+        out->data[out->used++] = (inst->w == 1) ? 'w' : 'b';
+    }
+    if (inst->dest.type == OPERAND_NONE) {
+        return;
+    }
+
+    out->data[out->used++] = ' ';
+    format_operand(out, inst, &inst->dest);
+    if (inst->source.type != OPERAND_NONE) {
+        output_string(out, ", ");
+        format_operand(out, inst, &inst->source);
+    }
+}
+
+// writes a register, effective address, immediate or jump target
+void format_operand(struct output *out, const struct instruction *inst, const struct operand *operand) {
+    if (operand->type == OPERAND_REGISTER) {
+        output_string(out, lookup_register(operand->reg));
+    } else if (operand->type == OPERAND_MEMORY) {
+        // without a register operand the size of the access has to be spelled out
+        if (operand->flags & OPERAND_POINTER) {
+            output_string(out, "far ");
+        } else if (inst->dest.type != OPERAND_REGISTER) {
+            output_string(out, inst->w == 1 ? "word " : "byte ");
+        }
+        if (inst->prefixes & PREFIX_SEGMENT) {
+            output_string(out, lookup_register(16 + ((inst->prefixes >> 4) & 0b11)));
+            out->data[out->used++] = ':';
+        }
+        out->data[out->used++] = '[';
+        // nasm leaves out a zero displacement and makes a word one a byte where it fits
+        short displacement = operand->value;
+        if ((operand->flags & OPERAND_EXACT) && operand->mod == 0b01 && displacement == 0 && operand->reg != 0b110) {
+            output_string(out, "byte ");
+        } else if ((operand->flags & OPERAND_EXACT) && operand->mod == 0b10 && displacement >= -128 && displacement < 128) {
+            output_string(out, "word ");
+        }
+        if (operand->mod == 0b00 && operand->reg == 0b110) {     // direct address
+            out->data[out->used++] = '+';
+            output_unsigned(out, operand->value);
+        } else {
+            output_string(out, lookup_effective_address(operand->reg));
+            if (displacement > 0) {
+                out->data[out->used++] = '+';
+            }
+            if (displacement != 0) {
+                output_signed(out, displacement);
+            }
+        }
+        out->data[out->used++] = ']';
+    } else if (operand->type == OPERAND_IMMEDIATE) {
+        // the arithmetic operations have a sign extended byte form nasm prefers where it fits
+        short value = operand->value;
+        int arithmetic = inst->op == ADD || inst->op == SUB || inst->op == CMP || inst->op == ADC || inst->op == SBB
+                         || inst->op == AND || inst->op == OR || inst->op == XOR;
+        if ((operand->flags & (OPERAND_EXACT | OPERAND_SIGNED)) == OPERAND_EXACT && arithmetic && inst->w == 1 && value >= -128 && value < 128) {
+            output_string(out, "strict word ");
+        }
+        if (operand->flags & OPERAND_SIGNED) {
+            output_signed(out, (short)operand->value);
+        } else {
+            output_unsigned(out, operand->value);
+        }
+    } else if (operand->type == OPERAND_RELATIVE) {
+        // nasm's $ is the start of the instruction, the displacement counts from its end
+        int offset = (short)operand->value + inst->size;
+        if ((operand->flags & OPERAND_EXACT) && inst->op == JMP && inst->size == 3 && offset - 2 >= -128 && offset - 2 < 128) {
+            output_string(out, "near ");
+        }
+        out->data[out->used++] = '$';
+        if (offset >= 0) {
+            out->data[out->used++] = '+';
+        }
+        output_signed(out, offset);
+    } else if (operand->type == OPERAND_FAR) {
+        output_unsigned(out, inst->source.value);
+        out->data[out->used++] = ':';
+        output_unsigned(out, operand->value);
+    }
+}
+
+void output_init(struct output *out, int fd) {
+    out->data = malloc(OUTPUT_SIZE);
+    assert(out->data != NULL);
+    out->used = 0;
+    out->size = OUTPUT_SIZE;
+    out->fd = fd;
+}
+
+// makes sure another line fits, a line never exceeds MAX_LINE_LENGTH
+void output_reserve(struct output *out) {
+    if (out->used > out->size - MAX_LINE_LENGTH) {
+        output_flush(out);
+    }
+}
+
+// writes out everything collected so far, or for an output kept in memory makes room for more
+void output_flush(struct output *out) {
+    if (out->fd < 0) {
+        out->size *= 2;
+        out->data = realloc(out->data, out->size);
+        assert(out->data != NULL);
+        return;
+    }
+    write_all(out->fd, out->data, out->used);
+    out->used = 0;
+}
+
+// appends a block of text, which is written directly rather than copied when it is large. An
+// output kept in memory grows until the block fits
+void output_bytes(struct output *out, const char *data, size_t n) {
+    while (out->fd < 0 && n > out->size - out->used) {
+        output_flush(out);
+    }
+    if (n <= out->size - out->used) {
+        memcpy(out->data + out->used, data, n);
+        out->used += n;
+        return;
+    }
+    output_flush(out);
+    write_all(out->fd, data, n);
+}
+
+void write_all(int fd, const char *data, size_t n) {
+    size_t written = 0;
+    while (written < n) {
+        ssize_t bytes = write(fd, data + written, n - written);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        assert(bytes > 0);
+        written += bytes;
+    }
+}
+
+void output_string(struct output *out, const char *string) {
+    while (*string != '\0') {
+        out->data[out->used++] = *string++;
+    }
+}
+
+// converts to decimal text without going through stdio
+void output_unsigned(struct output *out, unsigned long long value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    while (n > 0) {
+        out->data[out->used++] = digits[--n];
+    }
+}
+
+// right aligns the number in a column of the given width
+void output_padded(struct output *out, unsigned long long value, int width) {
+    int length = 1;
+    for (unsigned long long rest = value; rest >= 10; rest /= 10) {
+        length++;
+    }
+    while (length++ < width) {
+        out->data[out->used++] = ' ';
+    }
+    output_unsigned(out, value);
+}
+
+void output_signed(struct output *out, int value) {
+    if (value < 0) {
+        out->data[out->used++] = '-';
+        output_unsigned(out, -(unsigned)value);
+    } else {
+        output_unsigned(out, value);
+    }
+}
+
+// writes 0x followed by at least the given number of hex digits
+void output_hex(struct output *out, unsigned value, int digits) {
+    char text[8];
+    int n = 0;
+    do {
+        text[n++] = "0123456789abcdef"[value & 0xf];
+        value >>= 4;
+    } while (value != 0 || n < digits);
+    output_string(out, "0x");
+    while (n > 0) {
+        out->data[out->used++] = text[--n];
+    }
+}
+
+// writes the set flags as letters, e.g. "CPS"
+void output_flags(struct output *out, unsigned short flags) {
+    static const char letters[] = "CPAZSTIDO";
+    static const unsigned short bits[] = {FLAG_C, FLAG_P, FLAG_A, FLAG_Z, FLAG_S, FLAG_T, FLAG_I, FLAG_D, FLAG_O};
+    for (int f = 0; f < 9; f++) {
+        if (flags & bits[f]) {
+            out->data[out->used++] = letters[f];
+        }
+    }
+}
+
+// simulates one run of the program on a fresh machine, or of the machine state being resumed
+void run_program(struct output *out, const char *path, const byte program[], int program_size, const struct options *options, struct cpu *machine) {
+    // the program is loaded at the start of a zeroed 1 MB memory
+    cpu_reset(machine);
+    struct cpu cpu = *machine;
+    cpu.variant = options->variant;
+    struct biu biu = {.capacity = (cpu.variant == CPU_8088) ? 4 : 6};
+    if (options->biu && cpu.variant != 0) {
+        cpu.biu = &biu;
+    }
+    if (options->snapshot != NULL) {
+        program_size = restore_snapshot(&cpu, options->snapshot, options->snapshot_size);
+        if (program_size < 0) {
+            fprintf(stderr, "%s is not a machine state file\n", path);
+            *machine = cpu;
+            return;
+        }
+    } else {
+        memcpy(cpu.memory, program, program_size);
+        memset(cpu.dirty, 1, (program_size + MEMORY_PAGE - 1) / MEMORY_PAGE);
+    }
+    biu.next = cpu.ip;
+    cpu.record = options->record;
+    if (options->profile) {
+        cpu.profile = calloc(0x10000, sizeof(struct profile_entry));
+        assert(cpu.profile != NULL);
+    }
+    struct access_log *accesses = NULL;
+    if (options->accesses) {
+        accesses = calloc(1, sizeof(struct access_log));
+        assert(accesses != NULL);
+    }
+
+    int trace = options->trace;
+    print_banner(out, options->variants, cpu.variant);
+    if (trace) {
+        print_execution_header(out, path);
+    }
+
+    if (cpu.record != NULL) {
+        size_t length = strlen(path);
+        if (length > MAX_TRACE_PATH) {
+            length = MAX_TRACE_PATH;
+        }
+        output_reserve(cpu.record);
+        cpu.record->data[cpu.record->used++] = RECORD_RUN;
+        cpu.record->data[cpu.record->used++] = options->variants;
+        cpu.record->data[cpu.record->used++] = cpu.variant;
+        output_word(cpu.record, length);
+        for (size_t c = 0; c < length; c++) {
+            output_reserve(cpu.record);
+            cpu.record->data[cpu.record->used++] = path[c];
+        }
+    }
+
+    // tracing, profiling, the access counts and the state file start where the fast-forward stops
+    if (options->fast_forward) {
+        unsigned long long count = fast_forward(&cpu, program_size, &options->until);
+        output_reserve(out);
+        output_string(out, "--- fast-forwarded ");
+        output_unsigned(out, count);
+        output_string(out, " instructions to ip ");
+        output_hex(out, cpu.ip, 0);
+        output_string(out, " ---\n");
+    }
+    if (options->save_path != NULL && options->fast_forward && save_snapshot(&cpu, program_size, options->save_path) != 0) {
+        fprintf(stderr, "cannot write %s\n", options->save_path);
+    }
+    cpu.accesses = accesses;
+
+    int features = (trace ? RUN_TRACE : 0) | (cpu.variant != 0 ? RUN_CLOCKS : 0) |
+                   (cpu.profile != NULL ? RUN_PROFILE : 0) | (cpu.record != NULL ? RUN_RECORD : 0) |
+                   (cpu.accesses != NULL ? RUN_ACCESSES : 0);
+    if (cpu.stop == 0) {
+        run_loops[features](&cpu, program_size, out);
+    }
+
+    // without a fast-forward the state is saved as the run ends
+    if (options->save_path != NULL && !options->fast_forward && save_snapshot(&cpu, program_size, options->save_path) != 0) {
+        fprintf(stderr, "cannot write %s\n", options->save_path);
+    }
+    if (options->dump_path != NULL && dump_memory(&cpu, options->dump_path) != 0) {
+        fprintf(stderr, "cannot write %s\n", options->dump_path);
+    }
+    if (options->image_path != NULL && dump_image(&cpu, options->image_path, options->image_address, options->image_width, options->image_height) != 0) {
+        fprintf(stderr, "cannot write %s\n", options->image_path);
+    }
+
+    if (cpu.ip < program_size) {
+        print_stop(out, &cpu.decoded[cpu.ip], cpu.ip);
+    }
+    print_registers(out, &cpu);
+    if (!trace && cpu.variant != 0) {
+        output_string(out, "Total clocks: ");
+        output_unsigned(out, cpu.clocks);
+        if (cpu.biu != NULL) {
+            output_string(out, " (");
+            output_unsigned(out, biu.stalls);
+            output_string(out, " waiting on the bus)");
+        }
+        output_string(out, "\n\n");
+    }
+    if (cpu.profile != NULL) {
+        print_profile(out, &cpu);
+    }
+    if (cpu.accesses != NULL) {
+        print_accesses(out, &cpu);
+    }
+    if (cpu.record != NULL) {
+        output_reserve(cpu.record);
+        cpu.record->data[cpu.record->used++] = RECORD_END;
+    }
+    free(cpu.profile);
+    cpu.profile = NULL;
+    free(cpu.accesses);
+    cpu.accesses = NULL;
+    cpu.biu = NULL;
+    *machine = cpu;
+}
+
+// with clocks each run starts with the manual's caveat, and with both processors also with a banner
+void print_banner(struct output *out, byte variants, byte variant) {
+    if (variant == 0) {
+        return;
+    }
+    output_reserve(out);
+    if (variants == (CPU_8086 | CPU_8088)) {
+        output_string(out, (variant == CPU_8086) ? "" : "\n");
+        output_string(out, "**************\n");
+        output_string(out, (variant == CPU_8086) ? "**** 8086 ****\n" : "**** 8088 ****\n");
+        output_string(out, "**************\n\n");
+    }
+    output_reserve(out);
+    output_string(out, "WARNING: Clocks reported by this utility are strictly from the 8086 manual.\n"
+                       "They will be inaccurate, both because the manual clocks are estimates, and because\n");
+    output_reserve(out);
+    output_string(out, "some of the entries in the manual look highly suspicious and are probably typos.\n\n");
+}
+
+void print_execution_header(struct output *out, const char *path) {
+    output_reserve(out);
+    output_string(out, "--- ");
+    output_string(out, path);
+    output_string(out, " execution ---\n");
+}
+
+// reads the whole program into the start of memory, returns its size or -1 on a read error
+int load_program(int fd, byte memory[]) {
+    int size = 0;
+    while (size < MEMORY_SIZE) {
+        ssize_t n = read(fd, memory + size, MEMORY_SIZE - size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        size += n;
+    }
+    return size;
+}
+
+// memory is padded so that decoding near the top of memory can't read past the end
+void cpu_init(struct cpu *cpu) {
+    memset(cpu, 0, sizeof(*cpu));
+    cpu->memory = calloc(MEMORY_SIZE + MAX_INSTRUCTION_LENGTH, 1);
+    cpu->decoded = calloc(0x10000, sizeof(struct instruction));
+    cpu->covered = calloc(0x10000, 1);
+    cpu->dirty = calloc(MEMORY_PAGES, 1);
+    assert(cpu->memory != NULL && cpu->decoded != NULL && cpu->covered != NULL && cpu->dirty != NULL);
+}
+
+// puts the machine back into its initial state, keeping its buffers for the next run
+void cpu_reset(struct cpu *cpu) {
+    struct cpu kept = *cpu;
+    memset(cpu, 0, sizeof(*cpu));
+    cpu->memory = kept.memory;
+    cpu->decoded = kept.decoded;
+    cpu->covered = kept.covered;
+    cpu->dirty = kept.dirty;
+    cpu->blocks = kept.blocks;
+    cpu->block_pool = kept.block_pool;
+    memset(cpu->memory, 0, MEMORY_SIZE + MAX_INSTRUCTION_LENGTH);
+    memset(cpu->decoded, 0, 0x10000 * sizeof(struct instruction));
+    memset(cpu->covered, 0, 0x10000);
+    memset(cpu->dirty, 0, MEMORY_PAGES);
+    if (cpu->blocks != NULL) {
+        memset(cpu->blocks, 0, 0x10000 * sizeof(struct block *));
+    }
+}
+
+void cpu_free(struct cpu *cpu) {
+    free(cpu->memory);
+    free(cpu->decoded);
+    free(cpu->covered);
+    free(cpu->dirty);
+    free(cpu->blocks);
+    free(cpu->block_pool);
+    free(cpu->profile);
+}
+
+// runs the program until ip leaves it. Instructions come out of the predecode cache, so hot
+// loops are decoded once and then only executed. features says which instrumentation to do; it is
+// always a constant, so each of the run_loops below is compiled with only its own instrumentation
+static inline __attribute__((always_inline))
+void simulate(struct cpu *cpu, unsigned program_size, struct output *out, const int features) {
+    struct cpu before;
+
+    while (cpu->ip < program_size) {
+        // the recording names each instruction once, by its bytes, every time it is decoded
+        int decoding = (features & RUN_RECORD) && cpu->decoded[cpu->ip].size == 0;
+        // a copy is traced, timed and recorded, as a far transfer empties the predecode cache
+        // while the instruction executes
+        const struct instruction current = *fetch(cpu);
+        const struct instruction *inst = &current;
+        if (decoding) {
+            record_code(cpu->record, cpu, inst);
+        }
+
+        const struct operation *operation = &operations[inst->op];
+        if ((operation->flags & OP_STOP || operation->execute == NULL) && must_stop(cpu, inst)) {
+            break;
+        }
+
+        // memory operands are timed by their address before the instruction changes any registers
+        struct timing timing = {0};
+        if (features & RUN_CLOCKS) {
+            estimate_clocks(cpu, inst, &timing);
+        }
+        if (features & (RUN_TRACE | RUN_RECORD)) {
+            before = *cpu;
+            get_flags(&before);
+        }
+        struct access_site site;
+        if (features & RUN_ACCESSES) {
+            locate_accesses(cpu, inst, &site);
+        }
+        unsigned short ip = cpu->ip, count = cpu->regs[CX];
+        int taken = execute(cpu, inst);
+        if (features & RUN_ACCESSES) {
+            note_accesses(cpu->accesses, cpu, inst, &site, taken, ip, count);
+        }
+        if (features & RUN_CLOCKS) {
+            if (inst->op == JUMP || inst->op == INTO || inst->prefixes) {
+                settle_clocks(cpu, inst, taken, count, &timing);
+            }
+            if (cpu->biu != NULL) {
+                biu_step(cpu, inst, taken || cpu->ip != (unsigned short)(ip + inst->size), count, &timing);
+            }
+            unsigned clocks = timing.base + timing.ea + timing.penalty + timing.stall;
+            cpu->clocks += clocks;
+            if (features & RUN_PROFILE) {
+                cpu->profile[ip].count++;
+                cpu->profile[ip].clocks += clocks;
+            }
+        }
+
+        if (features & RUN_TRACE) {
+            output_reserve(out);
+            format_instruction(out, inst);
+            output_string(out, " ; ");
+            if (features & RUN_CLOCKS) {
+                trace_clocks(out, &timing, cpu->clocks);
+            }
+            trace_changes(out, &before, cpu);
+            out->data[out->used++] = '\n';
+        }
+        if (features & RUN_RECORD) {
+            record_step(cpu->record, &before, cpu, inst, &timing);
+        }
+    }
+}
+
+// one specialization of simulate() per combination of features
+#define SIMULATE_WITH(features) \
+    void simulate_##features(struct cpu *cpu, unsigned program_size, struct output *out) { \
+        simulate(cpu, program_size, out, features); \
+    }
+SIMULATE_WITH(1)  SIMULATE_WITH(2)  SIMULATE_WITH(3)  SIMULATE_WITH(4)  SIMULATE_WITH(5)
+SIMULATE_WITH(6)  SIMULATE_WITH(7)  SIMULATE_WITH(8)  SIMULATE_WITH(9)  SIMULATE_WITH(10)
+SIMULATE_WITH(11) SIMULATE_WITH(12) SIMULATE_WITH(13) SIMULATE_WITH(14) SIMULATE_WITH(15)
+SIMULATE_WITH(16) SIMULATE_WITH(17) SIMULATE_WITH(18) SIMULATE_WITH(19) SIMULATE_WITH(20)
+SIMULATE_WITH(21) SIMULATE_WITH(22) SIMULATE_WITH(23) SIMULATE_WITH(24) SIMULATE_WITH(25)
+SIMULATE_WITH(26) SIMULATE_WITH(27) SIMULATE_WITH(28) SIMULATE_WITH(29) SIMULATE_WITH(30)
+SIMULATE_WITH(31)
+
+// without any instrumentation the program runs as translated blocks, which count nothing
+void run_fast(struct cpu *cpu, unsigned program_size, struct output *out) {
+    (void)out;
+    run_blocks(cpu, program_size);
+}
+
+// runs without any instrumentation but the clock estimate until the until point, the end of the
+// program or an instruction the run stops in front of, see must_stop(). Returns how many
+// instructions it executed
+unsigned long long fast_forward(struct cpu *cpu, unsigned program_size, const struct until *until) {
+    unsigned long long count = 0;
+    while (cpu->ip < program_size && cpu->ip != until->ip && count < until->count && cpu->clocks < until->clocks) {
+        // timed from a copy, as simulate() does
+        const struct instruction current = *fetch(cpu);
+        const struct instruction *inst = &current;
+        const struct operation *operation = &operations[inst->op];
+        if ((operation->flags & OP_STOP || operation->execute == NULL) && must_stop(cpu, inst)) {
+            break;
+        }
+
+        struct timing timing = {0};
+        if (cpu->variant != 0) {
+            estimate_clocks(cpu, inst, &timing);
+        }
+        unsigned short ip = cpu->ip, count_register = cpu->regs[CX];
+        int taken = execute(cpu, inst);
+        if (cpu->variant != 0) {
+            settle_clocks(cpu, inst, taken, count_register, &timing);
+            if (cpu->biu != NULL) {
+                biu_step(cpu, inst, taken || cpu->ip != (unsigned short)(ip + inst->size), count_register, &timing);
+            }
+            cpu->clocks += timing.base + timing.ea + timing.penalty + timing.stall;
+        }
+        count++;
+    }
+    return count;
+}
+
+// reads a fast-forward point like "ip=0x1a", "count=5000000" or "clocks=100000" into until
+int parse_until(const char *spec, struct until *until) {
+    const char *value = strchr(spec, '=');
+    if (value == NULL || value[1] == '\0') {
+        return -1;
+    }
+    char *end;
+    unsigned long long n = strtoull(value + 1, &end, 0);
+    if (*end != '\0') {
+        return -1;
+    }
+
+    size_t length = value - spec;
+    if (length == 2 && strncmp(spec, "ip", 2) == 0 && n < 0x10000) {
+        until->ip = n;
+    } else if (length == 5 && strncmp(spec, "count", 5) == 0) {
+        until->count = n;
+    } else if (length == 6 && strncmp(spec, "clocks", 6) == 0) {
+        until->clocks = n;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// writes the machine state to path: SNAPSHOT_MAGIC, the program size, ip, flags, the twelve
+// registers, the clocks so far, the variant they were estimated for and the count of CALLs not
+// returned from, all little endian, then
+// the dirty page map and the dirty pages in order. Pages never stored to are still zero and are
+// left out, and the pages are written straight from the memory image. Returns -1 on an error
+int save_snapshot(struct cpu *cpu, unsigned program_size, const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    byte header[SNAPSHOT_HEADER];
+    unsigned short flags = get_flags(cpu);
+    memcpy(header, SNAPSHOT_MAGIC, 4);
+    for (int k = 0; k < 4; k++) {
+        header[4 + k] = program_size >> (8 * k);
+    }
+    header[8] = cpu->ip;
+    header[9] = cpu->ip >> 8;
+    header[10] = flags;
+    header[11] = flags >> 8;
+    for (int r = 0; r < 12; r++) {
+        header[12 + 2 * r] = cpu->regs[r];
+        header[13 + 2 * r] = cpu->regs[r] >> 8;
+    }
+    for (int k = 0; k < 8; k++) {
+        header[36 + k] = cpu->clocks >> (8 * k);
+    }
+    header[44] = cpu->variant;
+    for (int k = 0; k < 4; k++) {
+        header[45 + k] = cpu->calls >> (8 * k);
+    }
+    write_all(fd, (const char *)header, SNAPSHOT_HEADER);
+    write_all(fd, (const char *)cpu->dirty, MEMORY_PAGES);
+
+    // runs of consecutive dirty pages go out in one write each
+    unsigned end;
+    for (unsigned page = dirty_run(cpu, 0, &end); page < MEMORY_PAGES; page = dirty_run(cpu, end, &end)) {
+        write_all(fd, (const char *)cpu->memory + page * MEMORY_PAGE, (end - page) * MEMORY_PAGE);
+    }
+    return close(fd);
+}
+
+// finds the first run of dirty pages from page on: returns its first page, MEMORY_PAGES if there
+// is none, and sets end to the page after it
+unsigned dirty_run(const struct cpu *cpu, unsigned page, unsigned *end) {
+    while (page < MEMORY_PAGES && !cpu->dirty[page]) {
+        page++;
+    }
+    *end = page;
+    while (*end < MEMORY_PAGES && cpu->dirty[*end]) {
+        (*end)++;
+    }
+    return page;
+}
+
+// writes the whole 1 MB memory image to path, as raw bytes at their physical addresses. Only the
+// pages stored to are written, one write per run of them straight from memory, and the rest of
+// the file is left as a hole that reads as the zeros those pages still hold. Returns -1 on an error
+int dump_memory(const struct cpu *cpu, const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    unsigned end;
+    for (unsigned page = dirty_run(cpu, 0, &end); page < MEMORY_PAGES; page = dirty_run(cpu, end, &end)) {
+        if (lseek(fd, page * MEMORY_PAGE, SEEK_SET) < 0) {
+            close(fd);
+            return -1;
+        }
+        write_all(fd, (const char *)cpu->memory + page * MEMORY_PAGE, (end - page) * MEMORY_PAGE);
+    }
+    if (ftruncate(fd, MEMORY_SIZE) != 0) {
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+// writes width by height RGBA pixels starting at address as a PAM picture, the pixels straight
+// from memory after the header. Rows past the end of memory are left out
+int dump_image(const struct cpu *cpu, const char *path, unsigned address, unsigned width, unsigned height) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (width > 0 && height > (MEMORY_SIZE - address) / 4 / width) {
+        height = (MEMORY_SIZE - address) / 4 / width;
+    }
+
+    char header[128];
+    int length = sprintf(header, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", width, height);
+    write_all(fd, header, length);
+    write_all(fd, (const char *)cpu->memory + address, (size_t)width * height * 4);
+    return close(fd);
+}
+
+// loads a state written by save_snapshot() into a machine fresh from cpu_reset(), returns the
+// program size or -1 if the file is cut short. The pages restored are dirty again, so the state
+// can be saved once more. The clocks carry over only to a run timing the same processor
+int restore_snapshot(struct cpu *cpu, const byte snapshot[], size_t size) {
+    const byte *map = snapshot + SNAPSHOT_HEADER;
+    size_t pages = 0;
+    for (unsigned page = 0; page < MEMORY_PAGES; page++) {
+        pages += map[page] != 0;
+    }
+    if (size != SNAPSHOT_HEADER + MEMORY_PAGES + pages * MEMORY_PAGE) {
+        return -1;
+    }
+
+    const byte *data = map + MEMORY_PAGES;
+    for (unsigned page = 0; page < MEMORY_PAGES; page++) {
+        if (map[page] != 0) {
+            memcpy(cpu->memory + page * MEMORY_PAGE, data, MEMORY_PAGE);
+            cpu->dirty[page] = 1;
+            data += MEMORY_PAGE;
+        }
+    }
+
+    unsigned program_size = 0;
+    for (int k = 0; k < 4; k++) {
+        program_size |= (unsigned)snapshot[4 + k] << (8 * k);
+    }
+    cpu->ip = snapshot[8] | snapshot[9] << 8;
+    cpu->flags = snapshot[10] | snapshot[11] << 8;
+    cpu->lazy_op = NONE;
+    for (int r = 0; r < 12; r++) {
+        cpu->regs[r] = snapshot[12 + 2 * r] | snapshot[13 + 2 * r] << 8;
+    }
+    for (int k = 0; k < 8 && snapshot[44] == cpu->variant; k++) {
+        cpu->clocks |= (unsigned long long)snapshot[36 + k] << (8 * k);
+    }
+    for (int k = 0; k < 4; k++) {
+        cpu->calls |= (unsigned)snapshot[45 + k] << (8 * k);
+    }
+    if (cpu->regs[CS] != cpu->decoded_cs) {
+        flush_decoded(cpu);
+    }
+    return (program_size <= MEMORY_SIZE) ? (int)program_size : -1;
+}
+
+// run loops indexed by the RUN_ features they were compiled for, run_program() picks one per run
+run_fn run_loops[32] = {
+    run_fast,    simulate_1,  simulate_2,  simulate_3,  simulate_4,  simulate_5,  simulate_6,  simulate_7,
+    simulate_8,  simulate_9,  simulate_10, simulate_11, simulate_12, simulate_13, simulate_14, simulate_15,
+    simulate_16, simulate_17, simulate_18, simulate_19, simulate_20, simulate_21, simulate_22, simulate_23,
+    simulate_24, simulate_25, simulate_26, simulate_27, simulate_28, simulate_29, simulate_30, simulate_31
+};
+
+// appends one executed instruction to the binary trace. Only what the renderer cannot work out
+// for itself is stored: the step byte says which of the new register values, new flags and new
+// ip (for a taken jump) follow, then come the clocks when the run estimates them. Old values are
+// whatever the renderer's registers hold. Words are little endian
+void record_step(struct output *record, const struct cpu *before, struct cpu *after, const struct instruction *inst, const struct timing *timing) {
+    output_reserve(record);
+    size_t step = record->used++;
+    record->data[step] = 0;
+
+    byte changed = 0;
+    for (int r = 0; r < 12; r++) {
+        changed += before->regs[r] != after->regs[r];
+    }
+    if (changed != 0) {
+        record->data[step] |= STEP_REGISTERS;
+        record->data[record->used++] = changed;
+        for (int r = 0; r < 12; r++) {
+            if (before->regs[r] != after->regs[r]) {
+                record->data[record->used++] = r;
+                output_word(record, after->regs[r]);
+            }
+        }
+    }
+
+    unsigned short flags = get_flags(after);
+    if (flags != before->flags) {
+        record->data[step] |= STEP_FLAGS;
+        output_word(record, flags);
+    }
+    if (after->ip != (unsigned short)(before->ip + inst->size)) {
+        record->data[step] |= STEP_IP;
+        output_word(record, after->ip);
+    }
+
+    if (after->variant != 0) {
+        output_word(record, timing->base);
+        record->data[record->used++] = timing->ea;
+        record->data[record->used++] = timing->penalty;
+    }
+}
+
+// names the instruction just decoded at ip by its bytes, which the renderer decodes again
+void record_code(struct output *record, const struct cpu *cpu, const struct instruction *inst) {
+    output_reserve(record);
+    record->data[record->used++] = RECORD_CODE;
+    output_word(record, cpu->ip);
+    record->data[record->used++] = inst->size;
+    for (unsigned k = 0; k < inst->size; k++) {
+        record->data[record->used++] = cpu->memory[(cpu->code_base + cpu->ip + k) & (MEMORY_SIZE - 1)];
+    }
+}
+
+void output_word(struct output *out, unsigned short value) {
+    out->data[out->used++] = value & 0xff;
+    out->data[out->used++] = value >> 8;
+}
+
+// turns a binary trace back into the text -exec prints, replaying it on registers of its own.
+// The trace is checked as it is read: returns -1 when it is not a trace or a record is cut short
+// or malformed, after rendering the records before it
+int render_trace(struct output *out, const byte trace[], size_t size) {
+    if (size < 4 || memcmp(trace, TRACE_MAGIC, 4) != 0) {
+        return -1;
+    }
+    struct cpu cpu, before;
+    struct timing timing = {0};
+    struct instruction *decoded = calloc(0x10000, sizeof(struct instruction));
+    assert(decoded != NULL);
+    memset(&cpu, 0, sizeof(cpu));
+
+    size_t i = 4;
+    int status = 0;
+    while (i < size && status == 0) {
+        byte kind = trace[i++];
+        size_t left = size - i;
+        if (kind == RECORD_RUN) {
+            unsigned length = left < 4 ? 0 : trace[i + 2] | trace[i + 3] << 8;
+            if (left < 4 || left - 4 < length || length > MAX_TRACE_PATH
+                || (trace[i] & ~(CPU_8086 | CPU_8088)) != 0 || trace[i + 1] > CPU_8088) {
+                status = -1;
+                break;
+            }
+            memset(&cpu, 0, sizeof(cpu));
+            memset(decoded, 0, 0x10000 * sizeof(struct instruction));
+            byte variants = trace[i];
+            cpu.variant = trace[i + 1];
+            i += 4;
+
+            char path[MAX_TRACE_PATH + 1];
+            memcpy(path, trace + i, length);
+            path[length] = '\0';
+            i += length;
+            print_banner(out, variants, cpu.variant);
+            print_execution_header(out, path);
+        } else if (kind == RECORD_CODE) {
+            if (left < 3 || trace[i + 2] == 0 || trace[i + 2] > MAX_INSTRUCTION_LENGTH || left - 3 < trace[i + 2]) {
+                status = -1;
+                break;
+            }
+            // decoded from a padded copy, as the decoders may read past the end of the instruction
+            unsigned short ip = trace[i] | trace[i + 1] << 8;
+            byte bytes[MAX_INSTRUCTION_LENGTH * 2] = {0};
+            memcpy(bytes, trace + i + 3, trace[i + 2]);
+            i += 3 + trace[i + 2];
+            const struct opcode *entry = &decode_table[bytes[0]];
+            memset(&decoded[ip], 0, sizeof(struct instruction));
+            decoded[ip].size = entry->decoder(bytes, 0, entry->op, entry->w, &decoded[ip]);
+        } else if (kind == RECORD_END) {
+            print_stop(out, &decoded[cpu.ip], cpu.ip);
+            print_registers(out, &cpu);
+        } else {
+            // the whole step is measured before any of it is applied
+            size_t length = (kind & STEP_FLAGS ? 2 : 0) + (kind & STEP_IP ? 2 : 0) + (cpu.variant != 0 ? 4 : 0);
+            if (kind & STEP_REGISTERS) {
+                length += left < 1 ? 1 : 1 + 3 * (size_t)trace[i];
+            }
+            if ((kind & ~(STEP_REGISTERS | STEP_FLAGS | STEP_IP)) != 0 || left < length) {
+                status = -1;
+                break;
+            }
+            const struct instruction *inst = &decoded[cpu.ip];
+            before = cpu;
+            if (kind & STEP_REGISTERS) {
+                byte changed = trace[i++];
+                for (byte c = 0; c < changed && status == 0; c++, i += 3) {
+                    if (trace[i] >= sizeof(cpu.regs) / sizeof(cpu.regs[0])) {
+                        status = -1;
+                    } else {
+                        cpu.regs[trace[i]] = trace[i + 1] | trace[i + 2] << 8;
+                    }
+                }
+                if (status != 0) {
+                    break;
+                }
+            }
+            if (kind & STEP_FLAGS) {
+                cpu.flags = trace[i] | trace[i + 1] << 8;
+                i += 2;
+            }
+            cpu.ip += inst->size;
+            if (kind & STEP_IP) {
+                cpu.ip = trace[i] | trace[i + 1] << 8;
+                i += 2;
+            }
+
+            output_reserve(out);
+            format_instruction(out, inst);
+            output_string(out, " ; ");
+            if (cpu.variant != 0) {
+                timing.base = trace[i] | trace[i + 1] << 8;
+                timing.ea = trace[i + 2];
+                timing.penalty = trace[i + 3];
+                i += 4;
+                cpu.clocks += timing.base + timing.ea + timing.penalty;
+                trace_clocks(out, &timing, cpu.clocks);
+            }
+            trace_changes(out, &before, &cpu);
+            out->data[out->used++] = '\n';
+        }
+    }
+    free(decoded);
+    return status;
+}
+
+// returns the decoded instruction at cs:ip, decoding it from memory on the first visit
+const struct instruction *fetch(struct cpu *cpu) {
+    struct instruction *inst = &cpu->decoded[cpu->ip];
+    if (inst->size == 0) {
+        unsigned address = (cpu->code_base + cpu->ip) & (MEMORY_SIZE - 1);
+        const struct opcode *entry = &decode_table[cpu->memory[address]];
+        memset(inst, 0, sizeof(*inst));
+        inst->size = entry->decoder(cpu->memory, address, entry->op, entry->w, inst) - address;
+        for (unsigned k = 0; k < inst->size; k++) {
+            cpu->covered[(cpu->ip + k) & 0xffff] = 1;
+        }
+    }
+    return inst;
+}
+
+// forgets every decoded instruction and translation, for when cs moves the code segment
+void flush_decoded(struct cpu *cpu) {
+    memset(cpu->decoded, 0, 0x10000 * sizeof(struct instruction));
+    memset(cpu->covered, 0, 0x10000);
+    cpu->decoded_cs = cpu->regs[CS];
+    cpu->code_base = cpu->decoded_cs << 4;
+    cpu->code_dirty = 1;
+}
+
+// a store hit a byte that decoded instructions were read from: every entry that could span it
+// is marked for decoding again. Only the size is cleared, so an instruction that overwrites
+// itself still has its operands while it finishes executing
+void invalidate_decoded(struct cpu *cpu, unsigned offset) {
+    for (unsigned k = 0; k < MAX_INSTRUCTION_LENGTH; k++) {
+        struct instruction *inst = &cpu->decoded[(offset - k) & 0xffff];
+        if (inst->size > k) {
+            inst->size = 0;
+        }
+    }
+    cpu->covered[offset] = 0;
+    cpu->code_dirty = 1;
+}
+
+// every store to simulated memory goes through here to keep the predecode cache coherent and
+// to note the page as dirty
+void store_byte(struct cpu *cpu, unsigned address, byte value) {
+    cpu->memory[address] = value;
+    cpu->dirty[address / MEMORY_PAGE] = 1;
+    unsigned offset = (address - cpu->code_base) & (MEMORY_SIZE - 1);
+    if (offset < 0x10000 && cpu->covered[offset]) {
+        invalidate_decoded(cpu, offset);
+    }
+}
+
+// executes one decoded instruction with the handler of its operation, returns whether it was a
+// jump that was taken. The caller makes sure the operation has a handler, see must_stop()
+int execute(struct cpu *cpu, const struct instruction *inst) {
+    cpu->ip += inst->size;
+    return operations[inst->op].execute(cpu, inst);
+}
+
+int execute_mov(struct cpu *cpu, const struct instruction *inst) {
+    write_operand(cpu, inst, &inst->dest, read_operand(cpu, inst, &inst->source));
+    return 0;
+}
+
+// sp is decremented before a push of sp reads it, as the 8086 does
+int execute_push(struct cpu *cpu, const struct instruction *inst) {
+    cpu->regs[SP] -= 2;
+    write_word(cpu, segment_base(cpu, NULL, SS) + cpu->regs[SP], read_operand(cpu, inst, &inst->dest));
+    return 0;
+}
+
+int execute_pop(struct cpu *cpu, const struct instruction *inst) {
+    write_operand(cpu, inst, &inst->dest, pop_word(cpu));
+    return 0;
+}
+
+int execute_xchg(struct cpu *cpu, const struct instruction *inst) {
+    unsigned short dest = read_operand(cpu, inst, &inst->dest);
+    write_operand(cpu, inst, &inst->dest, read_operand(cpu, inst, &inst->source));
+    write_operand(cpu, inst, &inst->source, dest);
+    return 0;
+}
+
+// al is replaced by the byte at bx + al in the data segment
+int execute_xlat(struct cpu *cpu, const struct instruction *inst) {
+    unsigned short offset = cpu->regs[BX] + (cpu->regs[AX] & 0xff);
+    byte value = cpu->memory[(segment_base(cpu, inst, DS) + offset) & (MEMORY_SIZE - 1)];
+    cpu->regs[AX] = (cpu->regs[AX] & 0xff00) | value;
+    return 0;
+}
+
+// LEA loads the offset of its memory operand, LDS and LES the far pointer stored there
+int execute_load_address(struct cpu *cpu, const struct instruction *inst) {
+    if (inst->op == LEA) {
+        write_operand(cpu, inst, &inst->dest, effective_offset(cpu, &inst->source));
+        return 0;
+    }
+    unsigned address = physical_address(cpu, inst, &inst->source);
+    write_operand(cpu, inst, &inst->dest, read_word(cpu, address));
+    cpu->regs[(inst->op == LDS) ? DS : ES] = read_word(cpu, (address + 2) & (MEMORY_SIZE - 1));
+    return 0;
+}
+
+// LAHF, SAHF, PUSHF and POPF. Only the bits the 8086 defines are kept
+int execute_flags_transfer(struct cpu *cpu, const struct instruction *inst) {
+    const unsigned short low = FLAG_S | FLAG_Z | FLAG_A | FLAG_P | FLAG_C;
+    unsigned short flags = get_flags(cpu);
+    switch (inst->op) {
+        case LAHF: cpu->regs[AX] = (cpu->regs[AX] & 0xff) | ((flags & low) << 8); break;
+        case SAHF: cpu->flags = (flags & ~low) | ((cpu->regs[AX] >> 8) & low); break;
+        case PUSHF: push_word(cpu, flags); break;
+        case POPF: cpu->flags = pop_word(cpu) & (low | FLAG_T | FLAG_I | FLAG_D | FLAG_O); break;
+    }
+    return 0;
+}
+
+// ADD, ADC, SUB, SBB and CMP
+int execute_arithmetic(struct cpu *cpu, const struct instruction *inst) {
+    unsigned short dest = read_operand(cpu, inst, &inst->dest);
+    unsigned short source = read_operand(cpu, inst, &inst->source);
+    unsigned short carry = (inst->op == ADC || inst->op == SBB) ? get_flags(cpu) & FLAG_C : 0;
+    unsigned short result = (inst->op == ADD || inst->op == ADC) ? dest + source + carry : dest - source - carry;
+    if (inst->w == 0) {
+        result &= 0xff;
+    }
+
+    record_flags(cpu, inst->op, inst->w, dest, source, result);
+    if (inst->op != CMP) {
+        write_operand(cpu, inst, &inst->dest, result);
+    }
+    return 0;
+}
+
+// INC and DEC leave the carry alone, so the flags before them are brought up to date first
+int execute_increment(struct cpu *cpu, const struct instruction *inst) {
+    unsigned short dest = read_operand(cpu, inst, &inst->dest);
+    unsigned short result = (inst->op == INC) ? dest + 1 : dest - 1;
+    if (inst->w == 0) {
+        result &= 0xff;
+    }
+    get_flags(cpu);
+    record_flags(cpu, inst->op, inst->w, dest, 1, result);
+    write_operand(cpu, inst, &inst->dest, result);
+    return 0;
+}
+
+// flags as for subtracting the operand from 0
+int execute_neg(struct cpu *cpu, const struct instruction *inst) {
+    unsigned short source = read_operand(cpu, inst, &inst->dest);
+    unsigned short result = -source;
+    if (inst->w == 0) {
+        result &= 0xff;
+    }
+    record_flags(cpu, NEG, inst->w, 0, source, result);
+    write_operand(cpu, inst, &inst->dest, result);
+    return 0;
+}
+
+// MUL and IMUL of al or ax into ax or dx:ax. Carry and overflow say whether the upper half is
+// needed, the other flags are undefined and left as they are
+int execute_multiply(struct cpu *cpu, const struct instruction *inst) {
+    unsigned short source = read_operand(cpu, inst, &inst->dest);
+    unsigned short flags = get_flags(cpu) & ~(FLAG_C | FLAG_O);
+    int wide;
+
+    if (inst->w == 0) {
+        unsigned short product;
+        if (inst->op == MUL) {
+            product = (cpu->regs[AX] & 0xff) * source;
+            wide = product > 0xff;
+        } else {
+            product = (signed char)cpu->regs[AX] * (signed char)source;
+            wide = (short)product != (signed char)product;
+        }
+        cpu->regs[AX] = product;
+    } else {
+        unsigned product;
+        if (inst->op == MUL) {
+            product = (unsigned)cpu->regs[AX] * source;
+            wide = product > 0xffff;
+        } else {
+            product = (int)(short)cpu->regs[AX] * (short)source;
+            wide = (int)product != (short)product;
+        }
+        cpu->regs[AX] = product;
+        cpu->regs[DX] = product >> 16;
+    }
+    cpu->flags = flags | (wide ? FLAG_C | FLAG_O : 0);
+    return 0;
+}
+
+// DIV and IDIV of ax or dx:ax, the quotient goes in al or ax and the remainder in ah or dx. A
+// divisor of 0 or a quotient that doesn't fit raises interrupt 0
+int execute_divide(struct cpu *cpu, const struct instruction *inst) {
+    unsigned short divisor = read_operand(cpu, inst, &inst->dest);
+    unsigned dividend = (inst->w == 1) ? (cpu->regs[DX] << 16) | cpu->regs[AX] : cpu->regs[AX];
+    int limit = (inst->w == 1) ? 0x7fff : 0x7f;
+    long quotient, remainder;
+
+    if (divisor == 0) {
+        interrupt(cpu, 0);
+        return 1;
+    }
+    if (inst->op == DIV) {
+        quotient = dividend / divisor;
+        remainder = dividend % divisor;
+        if (quotient > 2 * limit + 1) {
+            interrupt(cpu, 0);
+            return 1;
+        }
+    } else {
+        long signed_dividend = (inst->w == 1) ? (int)dividend : (short)dividend;
+        long signed_divisor = (inst->w == 1) ? (short)divisor : (signed char)divisor;
+        quotient = signed_dividend / signed_divisor;
+        remainder = signed_dividend % signed_divisor;
+        if (quotient > limit || quotient < -limit) {
+            interrupt(cpu, 0);
+            return 1;
+        }
+    }
+
+    if (inst->w == 1) {
+        cpu->regs[AX] = quotient;
+        cpu->regs[DX] = remainder;
+    } else {
+        cpu->regs[AX] = ((remainder & 0xff) << 8) | (quotient & 0xff);
+    }
+    return 0;
+}
+
+// the decimal adjustments AAA, DAA, AAS, DAS, AAM and AAD, see chapter 2 of the manual
+int execute_adjust(struct cpu *cpu, const struct instruction *inst) {
+    unsigned short flags = get_flags(cpu);
+    byte al = cpu->regs[AX] & 0xff, ah = cpu->regs[AX] >> 8;
+    int adjust = (al & 0x0f) > 9 || (flags & FLAG_A);
+
+    switch (inst->op) {
+        case AAA:
+        case AAS:
+            flags &= ~(FLAG_A | FLAG_C);
+            if (adjust) {
+                al = (inst->op == AAA) ? al + 6 : al - 6;
+                ah = (inst->op == AAA) ? ah + 1 : ah - 1;
+                flags |= FLAG_A | FLAG_C;
+            }
+            al &= 0x0f;
+            break;
+        case DAA:
+        case DAS: {
+            int carry = al > 0x99 || (flags & FLAG_C);
+            flags &= ~(FLAG_A | FLAG_C);
+            if (adjust) {
+                al = (inst->op == DAA) ? al + 6 : al - 6;
+                flags |= FLAG_A;
+            }
+            if (carry) {
+                al = (inst->op == DAA) ? al + 0x60 : al - 0x60;
+                flags |= FLAG_C;
+            }
+            break;
+        }
+        case AAM:
+            ah = al / 10;
+            al = al % 10;
+            break;
+        case AAD:
+            al = ah * 10 + al;
+            ah = 0;
+            break;
+    }
+
+    cpu->regs[AX] = (ah << 8) | al;
+    cpu->flags = flags;
+    if (inst->op != AAA && inst->op != AAS) {
+        set_result_flags(cpu, 0, al);
+    }
+    return 0;
+}
+
+// CBW and CWD sign extend al into ah and ax into dx
+int execute_convert(struct cpu *cpu, const struct instruction *inst) {
+    if (inst->op == CBW) {
+        cpu->regs[AX] = (signed char)cpu->regs[AX];
+    } else {
+        cpu->regs[DX] = (cpu->regs[AX] & 0x8000) ? 0xffff : 0;
+    }
+    return 0;
+}
+
+int execute_not(struct cpu *cpu, const struct instruction *inst) {
+    write_operand(cpu, inst, &inst->dest, ~read_operand(cpu, inst, &inst->dest));
+    return 0;
+}
+
+// shifts and rotates one bit at a time, count times. Rotates only change carry and overflow,
+// shifts also set zero, sign and parity from the result. A count of 0 changes nothing
+int execute_shift(struct cpu *cpu, const struct instruction *inst) {
+    unsigned short value = read_operand(cpu, inst, &inst->dest);
+    byte count = read_operand(cpu, inst, &inst->source);
+    unsigned short sign = (inst->w == 1) ? 0x8000 : 0x80;
+    unsigned short mask = (inst->w == 1) ? 0xffff : 0xff;
+    if (count == 0) {
+        return 0;
+    }
+
+    unsigned short flags = get_flags(cpu);
+    int carry = (flags & FLAG_C) != 0, overflow = 0;
+    for (byte n = 0; n < count; n++) {
+        int out;
+        switch (inst->op) {
+            case SHL: out = (value & sign) != 0; value = (value << 1) & mask; break;
+            case SHR: out = value & 1; overflow = (value & sign) != 0; value >>= 1; break;
+            case SAR: out = value & 1; value = (value >> 1) | (value & sign); break;
+            case ROL: out = (value & sign) != 0; value = ((value << 1) | out) & mask; break;
+            case ROR: out = value & 1; value = (value >> 1) | (out ? sign : 0); break;
+            case RCL: out = (value & sign) != 0; value = ((value << 1) | carry) & mask; break;
+            default: out = value & 1; value = (value >> 1) | (carry ? sign : 0); break;  // RCR
+        }
+        carry = out;
+    }
+    if (inst->op == SHL || inst->op == ROL || inst->op == RCL) {
+        overflow = ((value & sign) != 0) != carry;
+    } else if (inst->op == ROR || inst->op == RCR) {
+        overflow = ((value ^ (value << 1)) & sign) != 0;
+    }
+
+    flags &= ~(FLAG_C | FLAG_O);
+    cpu->flags = flags | (carry ? FLAG_C : 0) | (overflow ? FLAG_O : 0);
+    if (inst->op == SHL || inst->op == SHR || inst->op == SAR) {
+        cpu->flags &= ~FLAG_A;
+        set_result_flags(cpu, inst->w, value);
+    }
+    write_operand(cpu, inst, &inst->dest, value);
+    return 0;
+}
+
+// AND, TEST, OR and XOR clear carry and overflow, TEST only sets the flags
+int execute_logic(struct cpu *cpu, const struct instruction *inst) {
+    unsigned short dest = read_operand(cpu, inst, &inst->dest);
+    unsigned short source = read_operand(cpu, inst, &inst->source);
+    unsigned short result;
+    switch (inst->op) {
+        case AND: case TEST: result = dest & source; break;
+        case OR: result = dest | source; break;
+        default: result = dest ^ source; break;
+    }
+
+    record_flags(cpu, inst->op, inst->w, dest, source, result);
+    if (inst->op != TEST) {
+        write_operand(cpu, inst, &inst->dest, result);
+    }
+    return 0;
+}
+
+// MOVS, CMPS, SCAS, LODS and STOS. The source is ds:si, or another segment with an override,
+// the destination es:di. With REP they repeat until cx runs out, CMPS and SCAS also stop when
+// the zero flag no longer matches the prefix
+int execute_string(struct cpu *cpu, const struct instruction *inst) {
+    int repeat = (inst->prefixes & (PREFIX_REP | PREFIX_REPNE)) != 0;
+    short step = (get_flags(cpu) & FLAG_D) ? -1 - inst->w : 1 + inst->w;
+    unsigned short mask = (inst->w == 1) ? 0xffff : 0xff;
+
+    while (!repeat || cpu->regs[CX] != 0) {
+        unsigned source = (segment_base(cpu, inst, DS) + cpu->regs[SI]) & (MEMORY_SIZE - 1);
+        unsigned dest = (segment_base(cpu, NULL, ES) + cpu->regs[DI]) & (MEMORY_SIZE - 1);
+        unsigned short a, b;
+
+        switch (inst->op) {
+            case MOVS:
+                a = read_word(cpu, source) & mask;
+                if (inst->w == 1) {
+                    write_word(cpu, dest, a);
+                } else {
+                    store_byte(cpu, dest, a);
+                }
+                break;
+            case CMPS:
+            case SCAS:
+                a = (inst->op == CMPS) ? read_word(cpu, source) & mask : cpu->regs[AX] & mask;
+                b = read_word(cpu, dest) & mask;
+                record_flags(cpu, CMP, inst->w, a, b, (a - b) & mask);
+                break;
+            case LODS:
+                a = read_word(cpu, source) & mask;
+                cpu->regs[AX] = (inst->w == 1) ? a : (cpu->regs[AX] & 0xff00) | a;
+                break;
+            default:                            // STOS
+                if (inst->w == 1) {
+                    write_word(cpu, dest, cpu->regs[AX]);
+                } else {
+                    store_byte(cpu, dest, cpu->regs[AX] & 0xff);
+                }
+                break;
+        }
+        if (inst->op == MOVS || inst->op == CMPS || inst->op == LODS) {
+            cpu->regs[SI] += step;
+        }
+        if (inst->op != LODS) {
+            cpu->regs[DI] += step;
+        }
+
+        if (!repeat) {
+            break;
+        }
+        cpu->regs[CX]--;
+        if (inst->op == CMPS || inst->op == SCAS) {
+            int zero = (get_flags(cpu) & FLAG_Z) != 0;
+            if (zero != ((inst->prefixes & PREFIX_REP) != 0)) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+// conditional jumps and loops
+int execute_jump(struct cpu *cpu, const struct instruction *inst) {
+    if (jump_taken(cpu, inst->cond)) {
+        cpu->ip += (short)inst->dest.value;
+        return 1;
+    }
+    return 0;
+}
+
+// CALL pushes the return address, a far call cs first, then transfers like JMP
+int execute_call(struct cpu *cpu, const struct instruction *inst) {
+    if (inst->dest.type == OPERAND_FAR || (inst->dest.flags & OPERAND_POINTER)) {
+        push_word(cpu, cpu->regs[CS]);
+    }
+    push_word(cpu, cpu->ip);
+    cpu->calls++;
+    return execute_jmp(cpu, inst);
+}
+
+int execute_jmp(struct cpu *cpu, const struct instruction *inst) {
+    const struct operand *target = &inst->dest;
+    if (target->type == OPERAND_RELATIVE) {
+        cpu->ip += (short)target->value;
+    } else if (target->type == OPERAND_FAR) {
+        far_transfer(cpu, inst->source.value, target->value);
+    } else if (target->flags & OPERAND_POINTER) {
+        unsigned address = physical_address(cpu, inst, target);
+        far_transfer(cpu, read_word(cpu, (address + 2) & (MEMORY_SIZE - 1)), read_word(cpu, address));
+    } else {
+        cpu->ip = read_operand(cpu, inst, target);
+    }
+    return 1;
+}
+
+// RET and RETF, releasing the given number of bytes of parameters after the return address
+int execute_return(struct cpu *cpu, const struct instruction *inst) {
+    unsigned short ip = pop_word(cpu);
+    if (cpu->calls > 0) {
+        cpu->calls--;
+    }
+    if (inst->op == RETF) {
+        far_transfer(cpu, pop_word(cpu), ip);
+    } else {
+        cpu->ip = ip;
+    }
+    cpu->regs[SP] += inst->dest.value;
+    return 1;
+}
+
+// INT, INT3 and INTO, which only interrupts when the overflow flag is set
+int execute_interrupt(struct cpu *cpu, const struct instruction *inst) {
+    if (inst->op == INTO && !(get_flags(cpu) & FLAG_O)) {
+        return 0;
+    }
+    interrupt(cpu, (inst->op == INT) ? inst->dest.value : (inst->op == INT3) ? 3 : 4);
+    return 1;
+}
+
+int execute_iret(struct cpu *cpu, const struct instruction *inst) {
+    (void)inst;
+    unsigned short ip = pop_word(cpu);
+    unsigned short cs = pop_word(cpu);
+    get_flags(cpu);
+    cpu->flags = pop_word(cpu) & (FLAG_C | FLAG_P | FLAG_A | FLAG_Z | FLAG_S | FLAG_T | FLAG_I | FLAG_D | FLAG_O);
+    far_transfer(cpu, cs, ip);
+    return 1;
+}
+
+// CLC, CMC, STC, CLD, STD, CLI and STI
+int execute_flag_control(struct cpu *cpu, const struct instruction *inst) {
+    unsigned short flags = get_flags(cpu);
+    switch (inst->op) {
+        case CLC: flags &= ~FLAG_C; break;
+        case CMC: flags ^= FLAG_C; break;
+        case STC: flags |= FLAG_C; break;
+        case CLD: flags &= ~FLAG_D; break;
+        case STD: flags |= FLAG_D; break;
+        case CLI: flags &= ~FLAG_I; break;
+        case STI: flags |= FLAG_I; break;
+    }
+    cpu->flags = flags;
+    return 0;
+}
+
+// WAIT has no coprocessor to wait for, HLT stops the run before it gets here
+int execute_nothing(struct cpu *cpu, const struct instruction *inst) {
+    (void)cpu;
+    (void)inst;
+    return 0;
+}
+
+// pushes the flags, cs and ip and continues at the vector of the interrupt type in the table at 0
+void interrupt(struct cpu *cpu, byte type) {
+    push_word(cpu, get_flags(cpu));
+    cpu->flags &= ~(FLAG_I | FLAG_T);
+    push_word(cpu, cpu->regs[CS]);
+    push_word(cpu, cpu->ip);
+    far_transfer(cpu, read_word(cpu, type * 4 + 2), read_word(cpu, type * 4));
+}
+
+void far_transfer(struct cpu *cpu, unsigned short segment, unsigned short offset) {
+    cpu->regs[CS] = segment;
+    cpu->ip = offset;
+    if (segment != cpu->decoded_cs) {
+        flush_decoded(cpu);
+    }
+}
+
+void push_word(struct cpu *cpu, unsigned short value) {
+    cpu->regs[SP] -= 2;
+    write_word(cpu, segment_base(cpu, NULL, SS) + cpu->regs[SP], value);
+}
 
-int main(int argc, char *argv[]) {
-    // assert that exactly one command line arg is passed: the file path
-    assert(argc == 2);
+unsigned short pop_word(struct cpu *cpu) {
+    unsigned short value = read_word(cpu, segment_base(cpu, NULL, SS) + cpu->regs[SP]);
+    cpu->regs[SP] += 2;
+    return value;
+}
 
-    byte buffer[BUFFER_SIZE];   // buffer for holding bytes
-    FILE *fp;                   // file handle
+// little endian word at a physical address, wrapping at the top of memory
+unsigned short read_word(const struct cpu *cpu, unsigned address) {
+    address &= MEMORY_SIZE - 1;
+    return cpu->memory[address] | (cpu->memory[(address + 1) & (MEMORY_SIZE - 1)] << 8);
+}
 
-    // open file in read mode
-    fp = fopen(argv[1], "r");
-    assert(fp != NULL);
+void write_word(struct cpu *cpu, unsigned address, unsigned short value) {
+    address &= MEMORY_SIZE - 1;
+    store_byte(cpu, address, value & 0xff);
+    store_byte(cpu, (address + 1) & (MEMORY_SIZE - 1), value >> 8);
+}
 
-    // read raw bytes into buffer
-    size_t bytes_read = fread(buffer, sizeof(byte), BUFFER_SIZE, fp);
-    assert(bytes_read != 0);
+// works out where an instruction about to execute accesses memory, for note_accesses()
+void locate_accesses(const struct cpu *cpu, const struct instruction *inst, struct access_site *site) {
+    const struct operand *dest = &inst->dest, *source = &inst->source;
+    if (dest->type == OPERAND_MEMORY || source->type == OPERAND_MEMORY) {
+        site->memory = physical_address(cpu, inst, (dest->type == OPERAND_MEMORY) ? dest : source);
+    } else if (inst->op == XLAT) {
+        unsigned short offset = cpu->regs[BX] + (cpu->regs[AX] & 0xff);
+        site->memory = (segment_base(cpu, inst, DS) + offset) & (MEMORY_SIZE - 1);
+    }
+    site->stack = segment_base(cpu, NULL, SS);
+    site->source = segment_base(cpu, inst, DS);
+    site->dest = segment_base(cpu, NULL, ES);
+    site->sp = cpu->regs[SP];
+    site->si = cpu->regs[SI];
+    site->di = cpu->regs[DI];
+    site->step = (cpu->flags & FLAG_D) ? -1 - inst->w : 1 + inst->w;
+}
 
-    // decode bytes as instructions
-    decode(buffer, bytes_read);
+// adds the accesses of an instruction that just executed to the batch of -accesses, the same
+// reads and writes its handler made: of its memory operand, of the stack, of the strings and of
+// the interrupt table. taken is what execute() returned and count is cx from before
+void note_accesses(struct access_log *log, const struct cpu *cpu, const struct instruction *inst, const struct access_site *site, int taken, unsigned short ip, unsigned short count) {
+    const struct operand *dest = &inst->dest, *source = &inst->source;
+    byte width = (inst->w == 1) ? ACCESS_WORD : 0;
+    int pushes = 0, pops = 0, type = -1;
 
-    // close file
-    fclose(fp);
+    if (dest->type == OPERAND_MEMORY || source->type == OPERAND_MEMORY) {
+        int reads = 1, writes = dest->type == OPERAND_MEMORY;
+        switch (inst->op) {
+            case MOV: reads = source->type == OPERAND_MEMORY; break;
+            case POP: reads = 0; break;
+            case XCHG: writes = 1; break;
+            case LEA: reads = 0; writes = 0; break;
+            case CMP: case TEST: case MUL: case IMUL: case DIV: case IDIV: case PUSH: case CALL: case JMP: writes = 0; break;
+            case SHL: case SHR: case SAR: case ROL: case ROR: case RCL: case RCR:
+                writes = source->type != OPERAND_REGISTER || (count & 0xff) != 0;
+                break;
+        }
+        // far pointers are read as two words, the offset and then the segment
+        if (inst->op == LDS || inst->op == LES || (dest->flags & OPERAND_POINTER)) {
+            width = ACCESS_WORD;
+            note_access(log, site->memory + 2, ip, width);
+        }
+        if (reads) {
+            note_access(log, site->memory, ip, width);
+        }
+        if (writes) {
+            note_access(log, site->memory, ip, width | ACCESS_WRITE);
+        }
+    }
 
+    switch (inst->op) {
+        case PUSH: case PUSHF: pushes = 1; break;
+        case POP: case POPF: case RET: pops = 1; break;
+        case RETF: pops = 2; break;
+        case IRET: pops = 3; break;
+        case CALL: pushes = (dest->type == OPERAND_FAR || (dest->flags & OPERAND_POINTER)) ? 2 : 1; break;
+        case INT: type = dest->value; break;
+        case INT3: type = 3; break;
+        case INTO: type = taken ? 4 : -1; break;
+        case DIV: case IDIV: type = taken ? 0 : -1; break;
+        case XLAT: note_access(log, site->memory, ip, 0); break;
+        case MOVS: case CMPS: case SCAS: case LODS: case STOS: {
+            unsigned short elements = (inst->prefixes & (PREFIX_REP | PREFIX_REPNE)) ? count - cpu->regs[CX] : 1;
+            for (unsigned short k = 0; k < elements; k++) {
+                unsigned short offset = k * site->step;
+                if (inst->op == MOVS || inst->op == CMPS || inst->op == LODS) {
+                    note_access(log, site->source + (unsigned short)(site->si + offset), ip, width);
+                }
+                if (inst->op != LODS) {
+                    note_access(log, site->dest + (unsigned short)(site->di + offset), ip, width | ((inst->op == MOVS || inst->op == STOS) ? ACCESS_WRITE : 0));
+                }
+            }
+            break;
+        }
+    }
+
+    // an interrupt pushes the flags, cs and ip and reads the segment and offset of its vector
+    if (type >= 0) {
+        pushes = 3;
+        note_access(log, type * 4 + 2, ip, ACCESS_WORD);
+        note_access(log, type * 4, ip, ACCESS_WORD);
+    }
+    for (int k = 1; k <= pushes; k++) {
+        note_access(log, site->stack + (unsigned short)(site->sp - 2 * k), ip, ACCESS_WORD | ACCESS_WRITE);
+    }
+    for (int k = 0; k < pops; k++) {
+        note_access(log, site->stack + (unsigned short)(site->sp + 2 * k), ip, ACCESS_WORD);
+    }
+}
+
+// adds an access to the batch of -accesses, counting the batch once it is full
+void note_access(struct access_log *log, unsigned address, unsigned short ip, byte kind) {
+    log->batch[log->used++] = (struct access) {address & (MEMORY_SIZE - 1), ip, kind};
+    if (log->used == ACCESS_BATCH) {
+        count_accesses(log);
+    }
+}
+
+// empties the batch into the counters
+void count_accesses(struct access_log *log) {
+    for (unsigned k = 0; k < log->used; k++) {
+        const struct access *access = &log->batch[k];
+        unsigned region = access->address / ACCESS_REGION;
+        log->regions[region][access->kind]++;
+        if ((access->kind & ACCESS_WORD) && (access->address & 1)) {
+            log->odd[region]++;
+            log->odd_ips[access->ip]++;
+        }
+    }
+    log->used = 0;
+}
+
+// whether the run has to stop in front of an instruction, noting why in cpu->stop: at HLT, at a
+// RET with no CALL left to return from, so it would return out of the program, or at an
+// instruction that can't be simulated, which is reported
+int must_stop(struct cpu *cpu, const struct instruction *inst) {
+    const struct operation *operation = &operations[inst->op];
+    if (inst->op == RET && cpu->calls != 0) {
+        return 0;
+    }
+    if (operation->flags & OP_STOP) {
+        cpu->stop = (inst->op == RET) ? STOP_RETURN : STOP_HALT;
+        return 1;
+    }
+    if (operation->execute == NULL) {
+        fprintf(stderr, "unsupported instruction 0x%02x at ip 0x%x\n", cpu->memory[cpu->code_base + cpu->ip], cpu->ip);
+        cpu->stop = STOP_UNSUPPORTED;
+        return 1;
+    }
     return 0;
 }
 
-// decodes op code and calls relevant decoder
-void decode(const byte buffer[], size_t n) {
-    unsigned i = 0;
-    byte op_code;
+// the programs of the listings return to nothing, so a run ends at their last RET
+void print_stop(struct output *out, const struct instruction *inst, unsigned short ip) {
+    if (inst->size != 0 && inst->op == RET) {
+        output_reserve(out);
+        output_string(out, "STOPONRET: Return encountered at address ");
+        output_unsigned(out, ip);
+        output_string(out, ".\n");
+    }
+}
 
-    while (i < n) {
-        op_code = buffer[i];
-
-        // check 8-bit op codes
-        if (op_code == 0b01110100) {            // JE: jump on equal
-            printf("je %d\n", (signed char)buffer[++i]);
-        } else if (op_code == 0b01111100) {     // JL: jump on less
-            printf("jl %d\n", (signed char)buffer[++i]);
-        } else if (op_code == 0b01111110) {     // JLE: jump on less or equal
-            printf("jle %d\n", (signed char)buffer[++i]);
-        } else if (op_code == 0b01110010) {     // JB: jump on below
-            printf("jb %d\n", (signed char)buffer[++i]);
-        } else if (op_code == 0b01110110) {     // JBE: jump on below or equal
-            printf("jbe %d\n", (signed char)buffer[++i]);
-        } else if (op_code == 0b01111010) {     // JPE: jump on parity even
-            printf("jpe %d\n", (signed char)buffer[++i]);
-        } else if (op_code == 0b01110000) {     // JO: jump on overflow
-            printf("jo %d\n", (signed char)buffer[++i]);
-        } else if (op_code == 0b01111000) {     // JS: jump on sign
-            printf("js %d\n", (signed char)buffer[++i]);
-        } else if (op_code == 0b01110101) {     // JNZ: jump on not zero
-            printf("jnz %d\n", (signed char)buffer[++i]);
-        } else if (op_code == 0b01111101) {     // JGE: jump on greater or equal
-            printf("jge %d\n", (signed char)buffer[++i]);
-        } else if (op_code == 0b01111111) {     // JG: jump on greater
-            printf("jg %d\n", (signed char)buffer[++i]);
-        } else if (op_code == 0b01110011) {     // JAE: jump on above or equal
-            printf("jae %d\n", (signed char)buffer[++i]);
-        } else if (op_code == 0b01110111) {     // JA: jump on above
-            printf("ja %d\n", (signed char)buffer[++i]);
-        } else if (op_code == 0b01111011) {     // JPO: jump on parity odd
-            printf("jnp %d\n", (signed char)buffer[++i]);
-        } else if (op_code == 0b01110001) {     // JNO: jump not overflow
-            printf("jno %d\n", (signed char)buffer[++i]);
-        }
-
-        // check 7-bit op codes
-        op_code >>= 1;
-        if (op_code == 0b1010000) {         // MOV memory to accumulator
-            i = decode_mov_mem_to_acc(buffer, i);
-            continue;
-        } else if (op_code == 0b1010001) {  // MOV accumulator to memory
-            i = decode_mov_acc_to_mem(buffer, i);
-            continue;
-        } else if (op_code == 0b1100011) {  // MOV immediate to register/memory
-            i = decode_mov_im_to_rm(buffer, i);
-            continue;
-        } else if (op_code == 0b0000010) {  // ADD immediate to accumulator
-            i = decode_im_to_acc(buffer, i, ADD);
-            continue;
-        } else if (op_code == 0b0010110) {  // SUB immediate from accumulator
-            i = decode_im_to_acc(buffer, i, SUB);
-            continue;
-        } else if (op_code == 0b0011110) {  // CMP immediate from accumulator
-            i = decode_im_to_acc(buffer, i, CMP);
-            continue;
+// estimates the clocks of an instruction about to execute. What depends on how it executes, the
+// conditional jumps, INTO and repeated string instructions, is left to settle_clocks()
+void estimate_clocks(const struct cpu *cpu, const struct instruction *inst, struct timing *timing) {
+    const struct operand *dest = &inst->dest, *source = &inst->source;
+    const struct operand *memory = (dest->type == OPERAND_MEMORY) ? dest : (source->type == OPERAND_MEMORY) ? source : NULL;
+    int transfers = (memory != NULL) ? 1 : 0;
+
+    timing->base = 0;
+    timing->ea = 0;
+    timing->penalty = 0;
+
+    switch (inst->op) {
+        case MOV:
+            if (memory != NULL && ((dest->flags | source->flags) & OPERAND_ACCUMULATOR)) {
+                timing->base = 10;                  // accumulator to or from a direct address, no EA
+            } else if (dest->type == OPERAND_MEMORY) {
+                timing->base = (source->type == OPERAND_IMMEDIATE) ? 10 : 9;
+            } else if (source->type == OPERAND_MEMORY) {
+                timing->base = 8;
+            } else {
+                timing->base = (source->type == OPERAND_IMMEDIATE) ? 4 : 2;
+            }
+            break;
+        case ADD:
+        case ADC:
+        case SUB:
+        case SBB:
+        case CMP:
+        case AND:
+        case OR:
+        case XOR:
+            if (dest->type == OPERAND_MEMORY) {
+                if (inst->op == CMP) {
+                    timing->base = (source->type == OPERAND_IMMEDIATE) ? 10 : 9;
+                } else {
+                    timing->base = (source->type == OPERAND_IMMEDIATE) ? 17 : 16;
+                    transfers = 2;                  // read, modify, write back
+                }
+            } else if (source->type == OPERAND_MEMORY) {
+                timing->base = 9;
+            } else {
+                timing->base = (source->type == OPERAND_IMMEDIATE) ? 4 : 3;
+            }
+            break;
+        case TEST:
+            if (source->type == OPERAND_IMMEDIATE) {
+                timing->base = (memory != NULL) ? 11 : (dest->flags & OPERAND_ACCUMULATOR) ? 4 : 5;
+            } else {
+                timing->base = (memory != NULL) ? 9 : 3;
+            }
+            break;
+        case INC:
+        case DEC:
+            timing->base = (memory != NULL) ? 15 : (inst->w == 1) ? 2 : 3;
+            transfers *= 2;
+            break;
+        case NEG:
+        case NOT:
+            timing->base = (memory != NULL) ? 16 : 3;
+            transfers *= 2;
+            break;
+        case SHL:
+        case SHR:
+        case SAR:
+        case ROL:
+        case ROR:
+        case RCL:
+        case RCR:
+            if (source->type == OPERAND_REGISTER) {
+                timing->base = ((memory != NULL) ? 20 : 8) + 4 * (cpu->regs[CX] & 0xff);
+            } else {
+                timing->base = (memory != NULL) ? 15 : 2;
+            }
+            transfers *= 2;
+            break;
+        case PUSH:
+            timing->base = (memory != NULL) ? 16 : (dest->reg >= 16) ? 10 : 11;
+            transfers *= 2;
+            break;
+        case POP:
+            timing->base = (memory != NULL) ? 17 : 8;
+            transfers *= 2;
+            break;
+        case XCHG:
+            timing->base = (memory != NULL) ? 17 : (dest->flags & OPERAND_ACCUMULATOR) ? 3 : 4;
+            transfers *= 2;
+            break;
+        case LDS:
+        case LES:
+            transfers = 2;
+            timing->base = operations[inst->op].clocks;
+            break;
+        case LEA:
+            transfers = 0;                          // only the address is calculated
+            timing->base = operations[inst->op].clocks;
+            break;
+        case MUL:
+        case IMUL:
+        case DIV:
+        case IDIV: {
+            // the manual gives ranges, these are their lower ends
+            static const byte multiply_clocks[4][2] = {{70, 118}, {80, 128}, {80, 144}, {101, 165}};
+            timing->base = multiply_clocks[inst->op - MUL][inst->w] + ((memory != NULL) ? 6 : 0);
+            break;
         }
+        case CALL:
+        case JMP:
+            if (dest->type == OPERAND_RELATIVE || dest->type == OPERAND_FAR) {
+                timing->base = (inst->op == JMP) ? 15 : (dest->type == OPERAND_FAR) ? 28 : 19;
+            } else if (dest->flags & OPERAND_POINTER) {
+                timing->base = (inst->op == JMP) ? 24 : 37;
+                transfers = 2;
+            } else if (memory != NULL) {
+                timing->base = (inst->op == JMP) ? 18 : 21;
+            } else {
+                timing->base = (inst->op == JMP) ? 11 : 16;
+            }
+            break;
+        case RET:
+        case RETF:
+            timing->base = (dest->type != OPERAND_IMMEDIATE) ? operations[inst->op].clocks : (inst->op == RET) ? 12 : 17;
+            break;
+        case JUMP:
+            break;
+        default:
+            timing->base = operations[inst->op].clocks;
+            break;
+    }
 
-        // check 6-bit op codes
-        op_code >>= 1;
-        if (op_code == 0b100010) {          // MOV register/memory to or from register
-            i = decode_rm_reg(buffer, i, MOV);
-            continue;
-        } else if (op_code == 0b000000) {   // ADD register/memory with register and store result in either
-            i = decode_rm_reg(buffer, i, ADD);
-            continue;
-        } else if (op_code == 0b001010) {   // SUB register/memory from register or vice versa and store result in either
-            i = decode_rm_reg(buffer, i, SUB);
-            continue;
-        } else if (op_code == 0b001110) {   // CMP register/memory from register or vice versa and store result in either
-            i = decode_rm_reg(buffer, i, CMP);
-            continue;
-        } else if (op_code == 0b100000) {   // ADD/SUB/CMP immediate with register/memory
-            i = decode_arithmetic_im_to_rm(buffer, i);
-            continue;
+    if (memory != NULL && !((dest->flags | source->flags) & OPERAND_ACCUMULATOR)) {
+        timing->ea = ea_clocks(memory);
+    }
+
+    // the 8088 moves every word as two bytes, the 8086 only splits words at odd addresses
+    if (memory != NULL && inst->w == 1) {
+        if (cpu->variant == CPU_8088 || (physical_address(cpu, inst, memory) & 1)) {
+            timing->penalty = 4 * transfers;
         }
+    }
+    timing->transfers = transfers + timing->penalty / 4;
+}
 
-        // check 4-bit op codes
-        op_code >>= 2;
-        if (op_code == 0b1011) {            // MOV immediate to register
-            i = decode_mov_im_to_reg(buffer, i);
-            continue;
+// fills in the clocks estimate_clocks() couldn't know before the instruction executed: whether
+// a jump was taken, and how often a string instruction repeated, from cx as it was before
+void settle_clocks(const struct cpu *cpu, const struct instruction *inst, int taken, unsigned short count, struct timing *timing) {
+    // clocks per repetition of MOVS, CMPS, SCAS, LODS and STOS after REP
+    static const byte repeat_clocks[5] = {17, 22, 15, 13, 10};
+
+    if (inst->op == JUMP) {
+        timing->base = jump_clocks[(inst->cond < 16) ? 0 : inst->cond - 15][taken];
+    } else if (inst->op == INTO && taken) {
+        timing->base = 53;
+    } else if ((operations[inst->op].flags & OP_STRING) && (inst->prefixes & (PREFIX_REP | PREFIX_REPNE))) {
+        timing->base = 9 + repeat_clocks[inst->op - MOVS] * (unsigned short)(count - cpu->regs[CX]);
+    }
+}
+
+// clocks to calculate an effective address. A displacement of 0 costs nothing, which is how
+// [bp] (always encoded with a displacement) comes out at 5
+byte ea_clocks(const struct operand *operand) {
+    if (operand->mod == 0b00 && operand->reg == 0b110) {
+        return 6;                                   // direct address
+    }
+    int displacement = operand->value != 0;
+    switch (operand->reg) {
+        case 0b000:                                 // bx+si
+        case 0b011:                                 // bp+di
+            return displacement ? 11 : 7;
+        case 0b001:                                 // bx+di
+        case 0b010:                                 // bp+si
+            return displacement ? 12 : 8;
+        default:                                    // single base or index register
+            return displacement ? 9 : 5;
+    }
+}
+
+// runs the bus interface alongside an instruction that just executed and puts the clocks the
+// execution unit waited in timing's stall. The manual's clocks assume the instruction is already
+// in the queue and the bus is free for its operands, so the waits come on top of them: for the
+// instruction bytes not fetched yet, and for a fetch under way to finish before each of the
+// instruction's own bus cycles, which take the last 4 clocks each of its execution. A jump
+// empties the queue and fetching starts over at the new ip
+void biu_step(struct cpu *cpu, const struct instruction *inst, int flushed, unsigned short count, struct timing *timing) {
+    struct biu *biu = cpu->biu;
+    unsigned stall = biu_run(biu, ~0u, inst->size);
+
+    // the stack and string elements go over the bus too, which estimate_clocks() doesn't count.
+    // A push or pop of memory has its stack word counted there already
+    unsigned stack = 0, elements = 0;
+    unsigned iterations = (inst->prefixes & (PREFIX_REP | PREFIX_REPNE)) ? (unsigned short)(count - cpu->regs[CX]) : 1;
+    switch (inst->op) {
+        case PUSH:
+        case POP:
+            stack = (inst->dest.type == OPERAND_MEMORY) ? 0 : 1;
+            break;
+        case PUSHF:
+        case POPF:
+        case RET:
+            stack = 1;
+            break;
+        case CALL:
+            stack = (inst->dest.type == OPERAND_FAR || (inst->dest.flags & OPERAND_POINTER)) ? 2 : 1;
+            break;
+        case RETF:
+            stack = 2;
+            break;
+        case IRET:
+            stack = 3;
+            break;
+        case INT:
+        case INT3:
+            stack = 5;                              // flags, cs and ip pushed, then the vector read
+            break;
+        case MOVS:
+        case CMPS:
+            elements = 2 * iterations;
+            break;
+        case SCAS:
+        case LODS:
+        case STOS:
+            elements = iterations;
+            break;
+    }
+    unsigned split = (cpu->variant == CPU_8088) ? 2 : 1;
+    unsigned cycles = timing->transfers + stack * split + elements * ((inst->w == 1) ? split : 1);
+
+    unsigned clocks = timing->base + timing->ea + timing->penalty;
+    unsigned computing = (clocks > 4 * cycles) ? clocks - 4 * cycles : 0;
+    biu_run(biu, computing, 0);
+    for (unsigned c = 0; c < cycles; c++) {
+        stall += biu->cycle;
+        biu_run(biu, biu->cycle, 0);
+    }
+
+    if (flushed) {
+        biu->queue = 0;
+        biu->cycle = 0;
+        biu->next = cpu->ip;
+    }
+    timing->stall = stall;
+    biu->stalls += stall;
+}
+
+// lets the bus interface run, fetching into the queue whenever the bus is idle and the queue has
+// room: a byte on the 8088, an aligned word or the odd byte before one on the 8086, which waits for
+// two free bytes. Runs for the given clocks, or with bytes until it could take that many bytes out
+// of the queue, which it does. Returns the clocks it ran
+unsigned biu_run(struct biu *biu, unsigned clocks, unsigned bytes) {
+    unsigned ran = 0;
+    for (;;) {
+        if (bytes != 0 && biu->queue != 0) {
+            unsigned taken = (biu->queue < bytes) ? biu->queue : bytes;
+            biu->queue -= taken;
+            bytes -= taken;
+            if (bytes == 0) {
+                return ran;
+            }
+        }
+        if (ran == clocks) {
+            return ran;
+        }
+        if (biu->cycle == 0) {
+            int room = biu->capacity - biu->queue;
+            if (room < ((biu->capacity == 4) ? 1 : 2)) {
+                return clocks;                      // nothing happens until the queue is drained, the clocks pass
+            }
+            biu->fetching = (biu->capacity == 4 || (biu->next & 1)) ? 1 : 2;
+            biu->cycle = 4;
         }
+        biu->cycle--;
+        ran++;
+        if (biu->cycle == 0) {
+            biu->queue += biu->fetching;
+            biu->next += biu->fetching;
+        }
+    }
+}
 
-        i++;
+// writes "Clocks: +N = total (base + EAea + Pp + Sstall) | ", leaving out the parts that are zero
+void trace_clocks(struct output *out, const struct timing *timing, unsigned long long total) {
+    output_string(out, "Clocks: +");
+    output_unsigned(out, timing->base + timing->ea + timing->penalty + timing->stall);
+    output_string(out, " = ");
+    output_unsigned(out, total);
+    if (timing->ea != 0 || timing->penalty != 0 || timing->stall != 0) {
+        output_string(out, " (");
+        output_unsigned(out, timing->base);
+        if (timing->ea != 0) {
+            output_string(out, " + ");
+            output_unsigned(out, timing->ea);
+            output_string(out, "ea");
+        }
+        if (timing->penalty != 0) {
+            output_string(out, " + ");
+            output_unsigned(out, timing->penalty);
+            out->data[out->used++] = 'p';
+        }
+        if (timing->stall != 0) {
+            output_string(out, " + ");
+            output_unsigned(out, timing->stall);
+            output_string(out, "stall");
+        }
+        out->data[out->used++] = ')';
     }
+    output_string(out, " | ");
 }
 
-// MOV immediate to register
-unsigned decode_mov_im_to_reg(const byte buffer[], unsigned i) {
-    byte w, reg;
-    w = (buffer[i] >> 3) & 1;       // whether the immediate is 8-bits (0) or 16-bits (1)
-    reg = buffer[i] & 0b111;        // destination register field encoding
-    char* reg_name = lookup_register(w, reg);   // decoded register
-    i++;
-    if (w == 1) {
-        i++;
-        short data = buffer[i-1] | (buffer[i] << 8);                // 16 bits of data goes in register
-        printf("mov %s, %d\n", reg_name, data);
-    } else {
-        printf("mov %s, %d\n", reg_name, (signed char)buffer[i]);   // 8 bits of data goes in register
+// remembers enough about an arithmetic operation to work out the flags if anything ever looks at them
+void record_flags(struct cpu *cpu, byte op, byte w, unsigned short dest, unsigned short source, unsigned short result) {
+    cpu->lazy_op = op;
+    cpu->lazy_w = w;
+    cpu->lazy_dest = dest;
+    cpu->lazy_source = source;
+    cpu->lazy_result = result;
+}
+
+// runs the program like simulate() without a trace, as translated basic blocks. Handlers tail
+// call the next handler of their block and the last one returns the successor block, which it
+// links to directly after the first lookup, so a hot loop keeps running block to block and only
+// comes back here at the end of the program, after self-modifying stores, or when the pool fills
+void run_blocks(struct cpu *cpu, unsigned program_size) {
+    if (cpu->blocks == NULL) {
+        cpu->blocks = calloc(0x10000, sizeof(struct block *));
+        cpu->block_pool = malloc(BLOCK_POOL_SIZE * sizeof(struct block));
+        assert(cpu->blocks != NULL && cpu->block_pool != NULL);
+    }
+    cpu->program_size = program_size;
+
+    while (cpu->ip < program_size) {
+        if (cpu->code_dirty) {
+            flush_blocks(cpu);
+        }
+
+        struct block *block = lookup_block(cpu, cpu->ip);
+        if (block == NULL && cpu->blocks_used == BLOCK_POOL_SIZE) {
+            flush_blocks(cpu);
+            block = lookup_block(cpu, cpu->ip);
+        }
+        // no block starts at an instruction the run may stop in front of. A RET that doesn't
+        // stop the run is executed on its own
+        if (block == NULL) {
+            const struct instruction *inst = fetch(cpu);
+            if (must_stop(cpu, inst)) {
+                break;
+            }
+            execute(cpu, inst);
+            continue;
+        }
+
+        while (block != NULL) {
+            block = block->uops[0].handler(cpu, block->uops);
+        }
     }
-    return ++i;
 }
 
-// MOV/ADD/SUB/CMP register/memory and register
-unsigned decode_rm_reg(const byte buffer[], unsigned i, char op) {
-    byte d, w, mod, reg, rm;
-    d = (buffer[i] >> 1) & 1;       // whether reg field is destination (1) or source (0)
-    w = buffer[i] & 1;              // whether this is a word (1) or byte (0) operation
-    i++;
-    mod = buffer[i] >> 6;           // mode field encoding
-    reg = (buffer[i] >> 3) & 0b111; // register field encoding
-    rm = buffer[i] & 0b111;         // register/memory field encoding
+struct block *lookup_block(struct cpu *cpu, unsigned short ip) {
+    struct block *block = cpu->blocks[ip];
+    return (block != NULL) ? block : translate_block(cpu, ip);
+}
 
-    if (op == MOV) {
-        printf("mov ");
-    } else if (op == ADD) {
-        printf("add ");
-    } else if (op == SUB) {
-        printf("sub ");
-    } else if (op == CMP) {
-        printf("cmp ");
+// translates the instructions from ip up to and including the next jump. Returns NULL when the
+// first instruction can't be executed or the pool is full
+struct block *translate_block(struct cpu *cpu, unsigned short ip) {
+    if (cpu->blocks_used == BLOCK_POOL_SIZE) {
+        return NULL;
     }
+    struct block *block = &cpu->block_pool[cpu->blocks_used];
+    block->next[0] = block->next[1] = NULL;
+    block->count = 0;
 
-    if (mod == 0b11) {              // register mode
-        char *dest = (d == 1) ? lookup_register(w, reg) : lookup_register(w, rm);
-        char *source = (d == 1) ? lookup_register(w, rm) : lookup_register(w, reg);
-        printf("%s, %s", dest, source);
-    } else {                        // memory mode
-        if (d == 1) {
-            printf("%s, ", lookup_register(w, reg));
-            i = print_effective_address(buffer, i, rm, mod);
-        } else {
-            i = print_effective_address(buffer, i , rm, mod);
-            printf(", %s", lookup_register(w, reg));
+    unsigned short start = ip;
+    int n = 0;
+    for (;;) {
+        // end the block with a fall through at the length limit, the end of the program, or an
+        // instruction that can't be executed
+        unsigned short saved_ip = cpu->ip;
+        cpu->ip = ip;
+        const struct instruction *inst = fetch(cpu);
+        cpu->ip = saved_ip;
+        const struct operation *operation = &operations[inst->op];
+        if (n == MAX_BLOCK_LENGTH || ip >= cpu->program_size || operation->execute == NULL || (operation->flags & OP_STOP)) {
+            if (n == 0) {
+                return NULL;
+            }
+            struct uop *uop = &block->uops[n];
+            uop->handler = uop_fall_through;
+            uop->block = block;
+            uop->ip = uop->next_ip = ip;
+            break;
+        }
+
+        struct uop *uop = &block->uops[n++];
+        memset(uop, 0, sizeof(*uop));
+        uop->block = block;
+        uop->ip = ip;
+        uop->next_ip = ip + inst->size;
+        uop->inst = *inst;
+        uop->handler = uop_generic;
+        block->count++;
+        ip += inst->size;
+
+        if (inst->op == JUMP) {
+            uop->handler = uop_jump;
+            uop->cond = inst->cond;
+            uop->displacement = inst->dest.value;
+            break;
+        }
+        if (operation->flags & OP_TRANSFER) {
+            uop->handler = uop_transfer;
+            break;
+        }
+
+        // word register destinations with a register or immediate source get a specialized
+        // handler, everything else goes through execute()
+        const struct operand *dest = &inst->dest, *source = &inst->source;
+        if (inst->w == 1 && dest->type == OPERAND_REGISTER && dest->reg >= 8 && dest->reg < 16
+                && (source->type == OPERAND_IMMEDIATE || (source->type == OPERAND_REGISTER && source->reg >= 8))) {
+            int imm = source->type == OPERAND_IMMEDIATE;
+            uop->dest = dest->reg - 8;
+            uop->source = source->reg - 8;
+            uop->value = source->value;
+            switch (inst->op) {
+                case MOV: uop->handler = imm ? uop_mov_imm : uop_mov_reg; break;
+                case ADD: uop->handler = imm ? uop_add_imm : uop_add_reg; break;
+                case SUB: uop->handler = imm ? uop_sub_imm : uop_sub_reg; break;
+                case CMP: uop->handler = imm ? uop_cmp_imm : uop_cmp_reg; break;
+            }
+
+            // fuse cmp with a conditional jump right after it, which can then be decided from
+            // the compared values without working out the flags
+            if (inst->op == CMP && ip < cpu->program_size) {
+                cpu->ip = ip;
+                const struct instruction *next = fetch(cpu);
+                cpu->ip = saved_ip;
+                if (next->op == JUMP && next->cond < 16) {
+                    uop->handler = imm ? uop_cmp_imm_jump : uop_cmp_reg_jump;
+                    uop->cond = next->cond;
+                    uop->displacement = next->dest.value;
+                    uop->next_ip = ip + next->size;
+                    block->count++;
+                    break;
+                }
+            }
         }
     }
 
-    putchar('\n');
-    return ++i;
+    cpu->blocks_used++;
+    cpu->blocks[start] = block;
+    return block;
 }
 
-// ADD/SUB/CMP immediate with register/memory
-unsigned decode_arithmetic_im_to_rm(const byte buffer[], unsigned i) {
-    byte s, w, mod, op, rm;
-    s = (buffer[i] >> 1) & 1;
-    w = buffer[i] & 1;
-    i++;
-    mod = buffer[i] >> 6;
-    op = (buffer[i] & 0b111000) >> 3;
-    rm = buffer[i] & 0b111;
+// drops every translation, after self-modifying stores or when the pool is full
+void flush_blocks(struct cpu *cpu) {
+    memset(cpu->blocks, 0, 0x10000 * sizeof(struct block *));
+    cpu->blocks_used = 0;
+    cpu->code_dirty = 0;
+}
 
-    if (op == 0b000) {
-        printf("add ");
-    } else if (op == 0b101) {
-        printf("sub ");
-    } else if (op == 0b111) {
-        printf("cmp ");
+// returns the successor of a block once its last uop has set ip, linking it for next time. A
+// link never goes past the end of the program, so linked successors need no checks
+struct block *chain(struct cpu *cpu, const struct uop *uop, int taken) {
+    struct block *next = uop->block->next[taken];
+    if (next == NULL) {
+        if (cpu->ip >= cpu->program_size) {
+            return NULL;
+        }
+        next = lookup_block(cpu, cpu->ip);
+        uop->block->next[taken] = next;
     }
+    return next;
+}
 
-    if (mod == 0b11) {
-        printf("%s", lookup_register(w, rm));
-    } else {
-        w == 1 ? printf("word ") : printf("byte ");
-        i = print_effective_address(buffer, i, rm, mod);
+#define NEXT_UOP(cpu, uop) return (uop)[1].handler(cpu, (uop) + 1)
+
+// anything without a specialized handler. Leaves the block when a store modified code
+struct block *uop_generic(struct cpu *cpu, const struct uop *uop) {
+    cpu->ip = uop->ip;
+    execute(cpu, &uop->inst);
+    if (cpu->code_dirty) {
+        return NULL;
     }
+    NEXT_UOP(cpu, uop);
+}
 
-    if (s == 1 && w == 1) {         // sign extend
-        short data = ((signed char)buffer[++i] << 8) >> 8;
-        printf(", %d", data);
-    } else if (s == 0 && w == 1) {  // read word of data
-        i += 2;
-        unsigned short data = buffer[i-1] | (buffer[i] << 8);
-        printf(", %u", data);
-    } else {                        // read byte of data
-        printf(", %u", buffer[++i]);
+struct block *uop_mov_imm(struct cpu *cpu, const struct uop *uop) {
+    cpu->regs[uop->dest] = uop->value;
+    NEXT_UOP(cpu, uop);
+}
+
+struct block *uop_mov_reg(struct cpu *cpu, const struct uop *uop) {
+    cpu->regs[uop->dest] = cpu->regs[uop->source];
+    NEXT_UOP(cpu, uop);
+}
+
+struct block *uop_add_imm(struct cpu *cpu, const struct uop *uop) {
+    unsigned short a = cpu->regs[uop->dest], b = uop->value;
+    record_flags(cpu, ADD, 1, a, b, a + b);
+    cpu->regs[uop->dest] = a + b;
+    NEXT_UOP(cpu, uop);
+}
+
+struct block *uop_add_reg(struct cpu *cpu, const struct uop *uop) {
+    unsigned short a = cpu->regs[uop->dest], b = cpu->regs[uop->source];
+    record_flags(cpu, ADD, 1, a, b, a + b);
+    cpu->regs[uop->dest] = a + b;
+    NEXT_UOP(cpu, uop);
+}
+
+struct block *uop_sub_imm(struct cpu *cpu, const struct uop *uop) {
+    unsigned short a = cpu->regs[uop->dest], b = uop->value;
+    record_flags(cpu, SUB, 1, a, b, a - b);
+    cpu->regs[uop->dest] = a - b;
+    NEXT_UOP(cpu, uop);
+}
+
+struct block *uop_sub_reg(struct cpu *cpu, const struct uop *uop) {
+    unsigned short a = cpu->regs[uop->dest], b = cpu->regs[uop->source];
+    record_flags(cpu, SUB, 1, a, b, a - b);
+    cpu->regs[uop->dest] = a - b;
+    NEXT_UOP(cpu, uop);
+}
+
+struct block *uop_cmp_imm(struct cpu *cpu, const struct uop *uop) {
+    unsigned short a = cpu->regs[uop->dest], b = uop->value;
+    record_flags(cpu, CMP, 1, a, b, a - b);
+    NEXT_UOP(cpu, uop);
+}
+
+struct block *uop_cmp_reg(struct cpu *cpu, const struct uop *uop) {
+    unsigned short a = cpu->regs[uop->dest], b = cpu->regs[uop->source];
+    record_flags(cpu, CMP, 1, a, b, a - b);
+    NEXT_UOP(cpu, uop);
+}
+
+struct block *uop_jump(struct cpu *cpu, const struct uop *uop) {
+    cpu->ip = uop->next_ip;
+    int taken = jump_taken(cpu, uop->cond);
+    if (taken) {
+        cpu->ip += uop->displacement;
     }
+    return chain(cpu, uop, taken);
+}
 
-    putchar('\n');
-    return ++i;
+struct block *uop_cmp_imm_jump(struct cpu *cpu, const struct uop *uop) {
+    unsigned short a = cpu->regs[uop->dest], b = uop->value;
+    record_flags(cpu, CMP, 1, a, b, a - b);
+    cpu->ip = uop->next_ip;
+    int taken = compare_taken(cpu, a, b, uop->cond);
+    if (taken) {
+        cpu->ip += uop->displacement;
+    }
+    return chain(cpu, uop, taken);
+}
+
+struct block *uop_cmp_reg_jump(struct cpu *cpu, const struct uop *uop) {
+    unsigned short a = cpu->regs[uop->dest], b = cpu->regs[uop->source];
+    record_flags(cpu, CMP, 1, a, b, a - b);
+    cpu->ip = uop->next_ip;
+    int taken = compare_taken(cpu, a, b, uop->cond);
+    if (taken) {
+        cpu->ip += uop->displacement;
+    }
+    return chain(cpu, uop, taken);
 }
 
-// ADD/SUB/CMP immediate with accumulator
-unsigned decode_im_to_acc(const byte buffer[], unsigned i, char op) {
-    byte w = buffer[i] & 1;
+struct block *uop_fall_through(struct cpu *cpu, const struct uop *uop) {
+    cpu->ip = uop->ip;
+    return chain(cpu, uop, 0);
+}
 
-    if (op == ADD) {
-        printf("add ");
-    } else if (op == SUB) {
-        printf("sub ");
-    } else if (op == CMP) {
-        printf("cmp ");
+// calls, returns, interrupts and the unconditional jumps end a block without a link, since many
+// of them go somewhere else each time
+struct block *uop_transfer(struct cpu *cpu, const struct uop *uop) {
+    cpu->ip = uop->ip;
+    execute(cpu, &uop->inst);
+    if (cpu->code_dirty || cpu->ip >= cpu->program_size) {
+        return NULL;
     }
+    return lookup_block(cpu, cpu->ip);
+}
 
-    if (w == 1) {
-        i += 2;
-        short data = buffer[i-1] | (buffer[i] << 8);
-        printf("ax %d", data);
-    } else {
-        printf("al %d", (signed char)buffer[++i]);
+// decides a conditional jump right after "cmp a, b" from the word values themselves. The
+// conditions that need parity, sign or overflow on their own fall back to the flags
+int compare_taken(struct cpu *cpu, unsigned short a, unsigned short b, byte cond) {
+    switch (cond) {
+        case 2: return a < b;                   // jb
+        case 3: return a >= b;                  // jnb
+        case 4: return a == b;                  // je
+        case 5: return a != b;                  // jne
+        case 6: return a <= b;                  // jbe
+        case 7: return a > b;                   // ja
+        case 12: return (short)a < (short)b;    // jl
+        case 13: return (short)a >= (short)b;   // jnl
+        case 14: return (short)a <= (short)b;   // jle
+        case 15: return (short)a > (short)b;    // jg
+        default: return jump_taken(cpu, cond);
     }
+}
 
-    putchar('\n');
-    return ++i;
+// decides a conditional jump or loop, see the table of jumps in chapter 2 of the manual
+int jump_taken(struct cpu *cpu, byte cond) {
+    if (cond >= 16) {
+        if (cond == 19) {                       // JCXZ
+            return cpu->regs[CX] == 0;
+        }
+        cpu->regs[CX]--;                        // LOOP variants decrement cx without touching flags
+        if (cpu->regs[CX] == 0) {
+            return 0;
+        }
+        if (cond == 18) {                       // LOOP
+            return 1;
+        }
+        int zero = (get_flags(cpu) & FLAG_Z) != 0;
+        return (cond == 17) ? zero : !zero;     // LOOPZ : LOOPNZ
+    }
+
+    unsigned short flags = get_flags(cpu);
+    int sign_overflow = ((flags & FLAG_S) != 0) != ((flags & FLAG_O) != 0);
+    int taken;
+    switch (cond >> 1) {                        // conditions come in pairs, the low bit negates
+        case 0: taken = (flags & FLAG_O) != 0; break;
+        case 1: taken = (flags & FLAG_C) != 0; break;
+        case 2: taken = (flags & FLAG_Z) != 0; break;
+        case 3: taken = (flags & (FLAG_C | FLAG_Z)) != 0; break;
+        case 4: taken = (flags & FLAG_S) != 0; break;
+        case 5: taken = (flags & FLAG_P) != 0; break;
+        case 6: taken = sign_overflow; break;
+        default: taken = sign_overflow || (flags & FLAG_Z) != 0; break;
+    }
+    return (cond & 1) ? !taken : taken;
 }
 
-// MOV memory to accumulator
-unsigned decode_mov_mem_to_acc(const byte buffer[], unsigned i) {
-    i += 2;
-    unsigned short address = buffer[i-1] | (buffer[i] << 8);
-    printf("mov ax [%d]\n", address);
-    return ++i;
+// brings flags up to date with the last arithmetic operation
+unsigned short get_flags(struct cpu *cpu) {
+    if (cpu->lazy_op == NONE) {
+        return cpu->flags;
+    }
+
+    unsigned a = cpu->lazy_dest, b = cpu->lazy_source, r = cpu->lazy_result;
+    unsigned sign = (cpu->lazy_w == 1) ? 0x8000 : 0x80;
+    unsigned short flags = cpu->flags & ~(FLAG_C | FLAG_P | FLAG_A | FLAG_Z | FLAG_S | FLAG_O);
+
+    switch (cpu->lazy_op) {
+        case ADD:
+        case ADC:
+        case INC:
+            // with a carry in, the carry out of the top bit is worked out from the bits themselves
+            if (cpu->lazy_op == INC) {
+                flags |= cpu->flags & FLAG_C;
+            } else if ((cpu->lazy_op == ADD) ? r < a : ((a & b) | ((a | b) & ~r)) & sign) {
+                flags |= FLAG_C;
+            }
+            if ((a ^ r) & (b ^ r) & sign) {
+                flags |= FLAG_O;
+            }
+            break;
+        case SUB:
+        case SBB:
+        case CMP:
+        case DEC:
+        case NEG:
+            if (cpu->lazy_op == DEC) {
+                flags |= cpu->flags & FLAG_C;
+            } else if ((cpu->lazy_op != SBB) ? b > a : ((~a & b) | ((~a | b) & r)) & sign) {
+                flags |= FLAG_C;
+            }
+            if ((a ^ b) & (a ^ r) & sign) {
+                flags |= FLAG_O;
+            }
+            break;
+        default:                                // AND, TEST, OR and XOR leave carry, overflow and auxiliary clear
+            a = r;
+            b = 0;
+            break;
+    }
+    if ((a ^ b ^ r) & 0x10) {
+        flags |= FLAG_A;
+    }
+    if (r == 0) {
+        flags |= FLAG_Z;
+    }
+    if (r & sign) {
+        flags |= FLAG_S;
+    }
+    if (!__builtin_parity(r & 0xff)) {          // parity of the low byte is even
+        flags |= FLAG_P;
+    }
+
+    cpu->flags = flags;
+    cpu->lazy_op = NONE;
+    return flags;
 }
 
-// MOV accumulator to memory
-unsigned decode_mov_acc_to_mem(const byte buffer[], unsigned i) {
-    i += 2;
-    unsigned short address = buffer[i-1] | (buffer[i] << 8);
-    printf("mov [%d] ax\n", address);
-    return ++i;
+// physical address of a memory operand: its effective offset into ds, or ss when bp is the
+// base, unless the instruction has a segment override
+unsigned physical_address(const struct cpu *cpu, const struct instruction *inst, const struct operand *operand) {
+    int bp_based = (operand->mod != 0b00 || operand->reg != 0b110) && (operand->reg == 0b010 || operand->reg == 0b011 || operand->reg == 0b110);
+    return (segment_base(cpu, inst, bp_based ? SS : DS) + effective_offset(cpu, operand)) & (MEMORY_SIZE - 1);
 }
 
-// MOV immediate to register/memory
-unsigned decode_mov_im_to_rm(const byte buffer[], unsigned i) {
-    byte w, mod, rm;
-    w = buffer[i] & 1;              // whether this is a word (1) or byte (0) operation
-    i++;
-    mod = buffer[i] >> 6;           // mode field encoding
-    rm = buffer[i] & 0b111;         // register/memory field encoding
+// base and index registers plus displacement
+unsigned short effective_offset(const struct cpu *cpu, const struct operand *operand) {
+    const unsigned short *regs = cpu->regs;
+    unsigned short offset = operand->value;
 
-    printf("mov ");
+    if (operand->mod != 0b00 || operand->reg != 0b110) {
+        switch (operand->reg) {
+            case 0b000: offset += regs[BX] + regs[SI]; break;
+            case 0b001: offset += regs[BX] + regs[DI]; break;
+            case 0b010: offset += regs[BP] + regs[SI]; break;
+            case 0b011: offset += regs[BP] + regs[DI]; break;
+            case 0b100: offset += regs[SI]; break;
+            case 0b101: offset += regs[DI]; break;
+            case 0b110: offset += regs[BP]; break;
+            case 0b111: offset += regs[BX]; break;
+        }
+    }
+    return offset;
+}
 
-    if (mod == 0b11) {
-        printf("%d", buffer[++i]);
-    } else {
-        i = print_effective_address(buffer, i, rm, mod);
+// start of the segment an access of the instruction goes to, segment unless it has an override.
+// Without an instruction there is no override, as for the stack and the destination of strings
+unsigned segment_base(const struct cpu *cpu, const struct instruction *inst, byte segment) {
+    if (inst != NULL && (inst->prefixes & PREFIX_SEGMENT)) {
+        segment = ES + ((inst->prefixes >> 4) & 0b11);
     }
+    return cpu->regs[segment] << 4;
+}
 
-    if (w == 1) {
-        i += 2;
-        unsigned short address = buffer[i-1] | (buffer[i] << 8);
-        printf(", word %d", address);
-    } else {
-        i++;
-        printf(", byte %d", buffer[i]);
+// zero, sign and parity of a result, for the operations that work their flags out at once
+void set_result_flags(struct cpu *cpu, byte w, unsigned short result) {
+    unsigned short sign = (w == 1) ? 0x8000 : 0x80;
+    unsigned short flags = cpu->flags & ~(FLAG_Z | FLAG_S | FLAG_P);
+    if ((result & (sign | (sign - 1))) == 0) {
+        flags |= FLAG_Z;
     }
+    if (result & sign) {
+        flags |= FLAG_S;
+    }
+    if (!__builtin_parity(result & 0xff)) {
+        flags |= FLAG_P;
+    }
+    cpu->flags = flags;
+}
 
-    putchar('\n');
-    return ++i;
+unsigned short read_operand(const struct cpu *cpu, const struct instruction *inst, const struct operand *operand) {
+    if (operand->type == OPERAND_REGISTER) {
+        if (operand->reg < 8) {                 // al..bh live in the low and high halves of ax..bx
+            return (cpu->regs[operand->reg & 0b11] >> ((operand->reg >> 2) * 8)) & 0xff;
+        }
+        return cpu->regs[operand->reg - 8];
+    } else if (operand->type == OPERAND_MEMORY) {
+        unsigned address = physical_address(cpu, inst, operand);
+        if (inst->w == 0) {
+            return cpu->memory[address];
+        }
+        return cpu->memory[address] | (cpu->memory[(address + 1) & (MEMORY_SIZE - 1)] << 8);
+    }
+    return (inst->w == 1) ? operand->value : (operand->value & 0xff);
 }
 
-// calculates and prints the effective address based on rm and mod
-unsigned print_effective_address(const byte buffer[], unsigned i, byte rm, byte mod) {
-    if (mod == 0b00) {          // no displacement (unless rm == 0b110, in which case 16-bit direct address)
-        if (rm == 0b110) {
-            i += 2;
-            unsigned short address = buffer[i-1] | (buffer[i] << 8);
-            printf("[%d]", address);
+void write_operand(struct cpu *cpu, const struct instruction *inst, const struct operand *operand, unsigned short value) {
+    if (operand->type == OPERAND_REGISTER) {
+        if (operand->reg < 8) {
+            unsigned shift = (operand->reg >> 2) * 8;
+            unsigned short *reg = &cpu->regs[operand->reg & 0b11];
+            *reg = (*reg & ~(0xff << shift)) | ((value & 0xff) << shift);
         } else {
-            printf("[%s]", lookup_effective_address(rm));
+            cpu->regs[operand->reg - 8] = value;
+            if (operand->reg == 8 + CS && value != cpu->decoded_cs) {
+                flush_decoded(cpu);
+            }
         }
-    } else if (mod == 0b01) {   // 8-bit displacement (sign extend to 16 bits, see page 4-20 of manual)
-        i++;
-        short address = ((signed char)buffer[i] << 8) >> 8;
-        if (address == 0) {
-            printf("[%s]", lookup_effective_address(rm));
-        } else if (address > 0) {
-            printf("[%s + %d]", lookup_effective_address(rm), address);
-        } else {
-            printf("[%s - %d]", lookup_effective_address(rm), abs(address));
+    } else if (operand->type == OPERAND_MEMORY) {
+        unsigned address = physical_address(cpu, inst, operand);
+        store_byte(cpu, address, value & 0xff);
+        if (inst->w == 1) {
+            store_byte(cpu, (address + 1) & (MEMORY_SIZE - 1), value >> 8);
         }
-    } else if (mod == 0b10) {   // 16-bit displacement
-        i += 2;
-        short address = buffer[i-1] | (buffer[i] << 8); // parse as signed
-        if (address == 0) {
-            printf("[%s]", lookup_effective_address(rm));
-        } else if (address > 0) {
-            printf("[%s + %d]", lookup_effective_address(rm), address);
-        } else {
-            printf("[%s - %d]", lookup_effective_address(rm), abs(address));
+    }
+}
+
+// register file in the order the trace and the final dump list it
+static const byte display_order[12] = {AX, BX, CX, DX, SP, BP, SI, DI, ES, CS, SS, DS};
+
+// writes the registers, ip and flags an instruction changed, like "bx:0x0->0x3e8 ip:0x0->0x3"
+void trace_changes(struct output *out, const struct cpu *before, struct cpu *after) {
+    for (int r = 0; r < 12; r++) {
+        byte reg = display_order[r];
+        if (before->regs[reg] != after->regs[reg]) {
+            output_string(out, lookup_register(8 + reg));
+            out->data[out->used++] = ':';
+            output_hex(out, before->regs[reg], 0);
+            output_string(out, "->");
+            output_hex(out, after->regs[reg], 0);
+            out->data[out->used++] = ' ';
         }
     }
 
-    return i;
+    output_string(out, "ip:");
+    output_hex(out, before->ip, 0);
+    output_string(out, "->");
+    output_hex(out, after->ip, 0);
+    out->data[out->used++] = ' ';
+
+    unsigned short flags = get_flags(after);
+    if (flags != before->flags) {
+        output_string(out, "flags:");
+        output_flags(out, before->flags);
+        output_string(out, "->");
+        output_flags(out, flags);
+        out->data[out->used++] = ' ';
+    }
 }
 
-// see chapter 4, page 20 of 8086 manual for these tables.
-char* lookup_register(byte w, byte reg) {
-    if (w == 0) {
-        switch (reg) {
-            case 0b000:
-                return "al";
-            case 0b001:
-                return "cl";
-            case 0b010:
-                return "dl";
-            case 0b011:
-                return "bl";
-            case 0b100:
-                return "ah";
-            case 0b101:
-                return "ch";
-            case 0b110:
-                return "dl";
-            case 0b111:
-                return "bl";
-            default:
-                assert(1 == 0); // should not reach here
-        }
-    } else {
-        switch (reg) {
-            case 0b000:
-                return "ax";
-            case 0b001:
-                return "cx";
-            case 0b010:
-                return "dx";
-            case 0b011:
-                return "bx";
-            case 0b100:
-                return "sp";
-            case 0b101:
-                return "bp";
-            case 0b110:
-                return "si";
-            case 0b111:
-                return "di";
-            default:
-                assert(1 == 0); // should not reach here
+// writes the non-zero registers at the end of a run
+void print_registers(struct output *out, struct cpu *cpu) {
+    output_reserve(out);
+    output_string(out, "\nFinal registers:\n");
+    for (int r = 0; r < 12; r++) {
+        byte reg = display_order[r];
+        if (cpu->regs[reg] != 0) {
+            output_reserve(out);
+            output_string(out, "      ");
+            output_string(out, lookup_register(8 + reg));
+            output_string(out, ": ");
+            output_hex(out, cpu->regs[reg], 4);
+            output_string(out, " (");
+            output_unsigned(out, cpu->regs[reg]);
+            output_string(out, ")\n");
         }
     }
+    if (cpu->ip != 0) {
+        output_string(out, "      ip: ");
+        output_hex(out, cpu->ip, 4);
+        output_string(out, " (");
+        output_unsigned(out, cpu->ip);
+        output_string(out, ")\n");
+    }
+    unsigned short flags = get_flags(cpu);
+    if (flags != 0) {
+        output_string(out, "   flags: ");
+        output_flags(out, flags);
+        out->data[out->used++] = '\n';
+    }
+    out->data[out->used++] = '\n';
+}
+
+// see chapter 4, page 20 of 8086 manual for these tables. Byte registers come first, then word
+// registers, then the segment registers, matching the reg values of struct operand
+char* lookup_register(byte reg) {
+    static char* names[20] = {
+        "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh",
+        "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+        "es", "cs", "ss", "ds"
+    };
+    assert(reg < 20);
+    return names[reg];
 }
 
 // see chapter 4, page 20 of 8086 manual for table
 char* lookup_effective_address(byte rm) {
-    switch (rm) {
-        case 0b000:
-            return "bx + si";
-        case 0b001:
-            return "bx + di";
-        case 0b010:
-            return "bp + si";
-        case 0b011:
-            return "bp + di";
-        case 0b100:
-            return "si";
-        case 0b101:
-            return "di";
-        case 0b110:
-            return "bp";
-        case 0b111:
-            return "bx";
-        default:
-            assert(0 == 1); // should not reach here
+    static char* names[8] = {"bx+si", "bx+di", "bp+si", "bp+di", "si", "di", "bp", "bx"};
+    assert(rm < 8);
+    return names[rm];
+}
+
+// ips of the profile ordered by clocks, then executions, then address. The profile being sorted is
+// passed through this since qsort() takes no context, one per thread for batches
+static _Thread_local const struct profile_entry *sorting;
+
+int compare_profile(const void *a, const void *b) {
+    const struct profile_entry *x = &sorting[*(const unsigned *)a], *y = &sorting[*(const unsigned *)b];
+    if (x->clocks != y->clocks) {
+        return (x->clocks > y->clocks) ? -1 : 1;
+    }
+    if (x->count != y->count) {
+        return (x->count > y->count) ? -1 : 1;
+    }
+    return (*(const unsigned *)a > *(const unsigned *)b) - (*(const unsigned *)a < *(const unsigned *)b);
+}
+
+// prints the flat profile: every executed instruction by the clocks spent in it, then the same for
+// basic blocks. Blocks start at the entry point, at the targets of executed jumps, after jumps and
+// wherever execution skipped bytes, and are costed by adding up their instructions. Shares are of
+// the clocks profiled, which leave out any spent in a fast-forward or before a resumed state
+void print_profile(struct output *out, struct cpu *cpu) {
+    const struct profile_entry *profile = cpu->profile;
+    unsigned *order = malloc(0x10000 * sizeof(unsigned));
+    byte *leader = calloc(0x10000, 1);
+    struct profile_entry *blocks = calloc(0x10000, sizeof(struct profile_entry));
+    unsigned short *block_end = calloc(0x10000, sizeof(unsigned short));
+    assert(order != NULL && leader != NULL && blocks != NULL && block_end != NULL);
+
+    // instructions are decoded again from memory as it is now, since the cache may have dropped them
+    struct instruction *insts = calloc(0x10000, sizeof(struct instruction));
+    assert(insts != NULL);
+    unsigned executed = 0;
+    unsigned long long total = 0;
+    leader[0] = 1;
+    for (unsigned ip = 0; ip < 0x10000; ip++) {
+        if (profile[ip].count == 0) {
+            continue;
+        }
+        unsigned address = (cpu->code_base + ip) & (MEMORY_SIZE - 1);
+        const struct opcode *entry = &decode_table[cpu->memory[address]];
+        insts[ip].size = entry->decoder(cpu->memory, address, entry->op, entry->w, &insts[ip]) - address;
+        if (operations[insts[ip].op].flags & OP_TRANSFER) {
+            leader[(ip + insts[ip].size) & 0xffff] = 1;
+            if (insts[ip].dest.type == OPERAND_RELATIVE) {
+                leader[(ip + insts[ip].size + insts[ip].dest.value) & 0xffff] = 1;
+            }
+        }
+        order[executed++] = ip;
+        total += profile[ip].clocks;
+    }
+
+    // gather blocks in address order, a block is costed under the ip it starts at
+    unsigned block_count = 0, start = 0, next = 0x10000;
+    for (unsigned e = 0; e < executed; e++) {
+        unsigned ip = order[e];
+        if (leader[ip] || ip != next) {
+            start = ip;
+            blocks[start].count = profile[ip].count;
+            block_count++;
+        }
+        blocks[start].clocks += profile[ip].clocks;
+        block_end[start] = ip;
+        next = ip + insts[ip].size;
+    }
+
+    output_reserve(out);
+    output_string(out, "Profile: ");
+    output_unsigned(out, total);
+    output_string(out, (cpu->variant == CPU_8088) ? " clocks on the 8088\n\n" : " clocks on the 8086\n\n");
+    output_string(out, "      clocks       %       count  ip\n");
+
+    sorting = profile;
+    qsort(order, executed, sizeof(unsigned), compare_profile);
+    for (unsigned e = 0; e < executed; e++) {
+        unsigned ip = order[e];
+        output_reserve(out);
+        output_padded(out, profile[ip].clocks, 12);
+        output_percent(out, profile[ip].clocks, total);
+        output_padded(out, profile[ip].count, 12);
+        output_string(out, "  ");
+        output_hex(out, ip, 4);
+        output_string(out, "  ");
+        format_instruction(out, &insts[ip]);
+        out->data[out->used++] = '\n';
+    }
+
+    output_string(out, "\n      clocks       %     entries  block\n");
+    executed = 0;
+    for (unsigned ip = 0; ip < 0x10000; ip++) {
+        if (blocks[ip].count != 0) {
+            order[executed++] = ip;
+        }
+    }
+    assert(executed == block_count);
+    sorting = blocks;
+    qsort(order, executed, sizeof(unsigned), compare_profile);
+    for (unsigned e = 0; e < executed; e++) {
+        unsigned ip = order[e];
+        output_reserve(out);
+        output_padded(out, blocks[ip].clocks, 12);
+        output_percent(out, blocks[ip].clocks, total);
+        output_padded(out, blocks[ip].count, 12);
+        output_string(out, "  ");
+        output_hex(out, ip, 4);
+        out->data[out->used++] = '-';
+        output_hex(out, block_end[ip], 4);
+        output_string(out, "  ");
+        format_instruction(out, &insts[block_end[ip]]);
+        out->data[out->used++] = '\n';
+    }
+    out->data[out->used++] = '\n';
+
+    free(order);
+    free(leader);
+    free(blocks);
+    free(block_end);
+    free(insts);
+}
+
+// prints the access counts of a run: the accesses to every region of memory that had any, by
+// width and direction, and then every ip that made word accesses at odd addresses, which the
+// 8086 has to split into two bus cycles, by how many it made
+void print_accesses(struct output *out, struct cpu *cpu) {
+    struct access_log *log = cpu->accesses;
+    count_accesses(log);
+
+    unsigned long long reads = 0, writes = 0, odd = 0;
+    for (unsigned region = 0; region < ACCESS_REGIONS; region++) {
+        reads += log->regions[region][0] + log->regions[region][ACCESS_WORD];
+        writes += log->regions[region][ACCESS_WRITE] + log->regions[region][ACCESS_WORD | ACCESS_WRITE];
+        odd += log->odd[region];
     }
+    output_reserve(out);
+    output_string(out, "Memory accesses: ");
+    output_unsigned(out, reads);
+    output_string(out, " reads, ");
+    output_unsigned(out, writes);
+    output_string(out, " writes, ");
+    output_unsigned(out, odd);
+    output_string(out, " words at odd addresses\n\n");
+    output_string(out, "   byte reads byte writes  word reads word writes   odd words  region\n");
+
+    for (unsigned region = 0; region < ACCESS_REGIONS; region++) {
+        const unsigned long long *counts = log->regions[region];
+        if ((counts[0] | counts[1] | counts[2] | counts[3]) == 0) {
+            continue;
+        }
+        output_reserve(out);
+        for (int kind = 0; kind < 4; kind++) {
+            output_padded(out, counts[kind], 12);
+        }
+        output_padded(out, log->odd[region], 12);
+        output_string(out, "  ");
+        output_hex(out, region * ACCESS_REGION, 5);
+        out->data[out->used++] = '-';
+        output_hex(out, (region + 1) * ACCESS_REGION - 1, 5);
+        out->data[out->used++] = '\n';
+    }
+
+    // instructions are decoded again from memory as it is now, as print_profile() does
+    if (odd != 0) {
+        struct odd_access *order = malloc(0x10000 * sizeof(struct odd_access));
+        assert(order != NULL);
+        unsigned count = 0;
+        for (unsigned ip = 0; ip < 0x10000; ip++) {
+            if (log->odd_ips[ip] != 0) {
+                order[count++] = (struct odd_access) {log->odd_ips[ip], ip};
+            }
+        }
+        qsort(order, count, sizeof(struct odd_access), compare_odd_access);
+
+        output_string(out, "\n   odd words       %  ip\n");
+        for (unsigned k = 0; k < count; k++) {
+            struct instruction inst = {0};
+            unsigned address = (cpu->code_base + order[k].ip) & (MEMORY_SIZE - 1);
+            const struct opcode *entry = &decode_table[cpu->memory[address]];
+            inst.size = entry->decoder(cpu->memory, address, entry->op, entry->w, &inst) - address;
+
+            output_reserve(out);
+            output_padded(out, order[k].count, 12);
+            output_percent(out, order[k].count, odd);
+            output_string(out, "  ");
+            output_hex(out, order[k].ip, 4);
+            output_string(out, "  ");
+            format_instruction(out, &inst);
+            out->data[out->used++] = '\n';
+        }
+        free(order);
+    }
+    out->data[out->used++] = '\n';
+}
+
+// ips of the access report by how many odd word accesses they made, then by address
+int compare_odd_access(const void *a, const void *b) {
+    const struct odd_access *x = a, *y = b;
+    if (x->count != y->count) {
+        return (x->count > y->count) ? -1 : 1;
+    }
+    return (x->ip > y->ip) - (x->ip < y->ip);
+}
+
+// writes part as a percentage of total with one decimal, right aligned in 8 columns
+void output_percent(struct output *out, unsigned long long part, unsigned long long total) {
+    unsigned long long tenths = (total != 0) ? (part * 1000 + total / 2) / total : 0;
+    output_padded(out, tenths / 10, 6);
+    out->data[out->used++] = '.';
+    out->data[out->used++] = '0' + tenths % 10;
 }
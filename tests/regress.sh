@@ -0,0 +1,99 @@
+#!/bin/sh
+# regression checks beyond the listings' expected output. Builds the simulator into a scratch
+# directory and stops at the first check that fails. Run from the repository root
+set -e
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cc -O2 -pthread -o "$work/sim8086" disassembler.c
+sim="$work/sim8086"
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+# a file big enough to be disassembled in parallel chunks, inside a batch whose results are
+# kept in memory until they are written in order
+listing=tests/listing_0042_completionist_decode
+for k in $(seq 1024); do cat $listing; done > "$work/large.bin"
+for k in $(seq 40); do cat "$work/large.bin"; done > "$work/larger.bin"
+{ echo "; $work/larger.bin"; "$sim" -threads 1 "$work/larger.bin"; echo "; $listing"; "$sim" $listing; } > "$work/expected.txt"
+"$sim" -batch -threads 4 "$work/larger.bin" $listing > "$work/batch.txt" || fail "batch over a large file"
+cmp -s "$work/expected.txt" "$work/batch.txt" || fail "batch over a large file differs from the serial disassembly"
+
+# inputs sharing a name in different directories each keep their own result file
+mkdir -p "$work/a" "$work/b" "$work/out"
+cp tests/listing_0037_single_register_mov "$work/a/x"
+cp tests/listing_0039_more_movs "$work/b/x"
+printf '%s\n' "$work/a/x" "$work/b/x" > "$work/manifest.txt"
+"$sim" -batch -threads 2 -outdir "$work/out" -manifest "$work/manifest.txt" || fail "batch into a directory"
+"$sim" "$work/a/x" | cmp -s - "$work/out/1-x.txt" || fail "first of two inputs named x"
+"$sim" "$work/b/x" | cmp -s - "$work/out/2-x.txt" || fail "second of two inputs named x"
+if "$sim" -batch -exec -record "$work/trace.bin" "$work/a/x" > /dev/null 2>&1; then fail "batch accepted -record"; fi
+if "$sim" -batch "$work/a/x" "$work/missing" > /dev/null 2>&1; then fail "batch with a missing input succeeded"; fi
+if "$sim" -batch -outdir "$work/missing" "$work/a/x" > /dev/null 2>&1; then fail "batch into a missing directory succeeded"; fi
+
+# a binary trace renders back to the -exec text, and a damaged one is refused rather than read
+# past its end
+listing=tests/listing_0054_draw_rectangle
+"$sim" -exec -8086 -record "$work/trace.bin" $listing > "$work/exec.txt"
+"$sim" -render "$work/trace.bin" > "$work/render.txt" || fail "render a trace"
+cmp -s "$work/exec.txt" "$work/render.txt" || fail "rendered trace differs from -exec"
+if "$sim" -exec -record "$work/missing/trace.bin" $listing > /dev/null 2>&1; then fail "record into a missing directory"; fi
+head -c 1000 "$work/trace.bin" > "$work/cut.bin"
+if "$sim" -render "$work/cut.bin" > /dev/null 2>&1; then fail "render a truncated trace"; fi
+printf '86T1\201\001\001\000\000\001\001\040\000\000\004\000\000\000' > "$work/regs.bin"
+if "$sim" -render "$work/regs.bin" > /dev/null 2>&1; then fail "render a trace writing register 32"; fi
+
+# a RET inside the program returns from its CALL, only a RET with no CALL to return from stops
+# the run, whether it is traced, run as translated blocks or reached by a fast-forward
+printf '\350\004\000\273\007\000\303\270\005\000\303' > "$work/call.bin"
+for options in "-exec" "-exec -quiet" "-exec -until count=2"; do
+    "$sim" $options "$work/call.bin" > "$work/call.txt"
+    grep -q "STOPONRET: Return encountered at address 6" "$work/call.txt" || fail "$options stops at a RET with a return address on the stack"
+    grep -q "bx: 0x0007" "$work/call.txt" || fail "$options doesn't return from a CALL"
+done
+
+# a program that sets up a stack of its own still stops at the RET it ends with
+printf '\274\000\001\273\007\000\303' > "$work/stack.bin"
+for options in "-exec" "-exec -quiet"; do
+    timeout 10 "$sim" $options "$work/stack.bin" > "$work/stack.txt" || fail "$options runs on past the last RET of a program with its own stack"
+    grep -q "STOPONRET: Return encountered at address 6" "$work/stack.txt" || fail "$options doesn't stop at the last RET of a program with its own stack"
+done
+
+# a fast-forward to a clock count times an 8086 unless told which processor to time
+"$sim" -exec -quiet -until clocks=30 tests/listing_0056_estimating_cycles | grep -q "fast-forwarded 7 instructions" || fail "-until clocks= without a processor"
+
+# a profile behind a fast-forward shares out only the clocks it saw, so the instructions add up
+# to its total
+"$sim" -exec -quiet -profile -until count=5 tests/listing_0057_challenge_cycles > "$work/profile.txt"
+awk '/^Profile:/ { total = $2 } /^ *[0-9]+ +[0-9.]+ +[0-9]+  0x/ && !blocks { sum += $1 } /entries  block/ { blocks = 1 }
+     END { exit !(total > 0 && total == sum) }' "$work/profile.txt" || fail "profile total after a fast-forward"
+
+# the instruction that makes a far transfer is still traced by name once the transfer has
+# emptied the predecode cache
+printf '\352\005\000\020\000\273\007\000' > "$work/far.bin"
+"$sim" -exec "$work/far.bin" | grep -q "^jmp 16:5 ; " || fail "a far jmp is traced without its name"
+
+# a segment override of an instruction without a memory operand is written in front of it
+printf '\056\244\046\254\363\056\245' > "$work/segment.bin"
+printf 'cs movsb\nes lodsb\nrep cs movsw\n' > "$work/segment.txt"
+"$sim" "$work/segment.bin" | cmp -s - "$work/segment.txt" || fail "segment overrides of string instructions"
+
+# -labels output reassembles with nasm to the same bytes, also where the file has an encoding
+# nasm would otherwise shorten: a near jmp to a short distance, labeled or not, word immediates
+# and displacements that fit a byte, a zero byte displacement, and string instructions with a
+# segment override
+if command -v nasm > /dev/null; then
+    printf '\351\000\000\201\306\005\000\005\005\000\213\107\000\213\207\005\000\213\206\000\000\351\020\000\201\077\377\377\203\306\376\056\244\046\254' > "$work/exact.bin"
+    for f in tests/listing_00* "$work/exact.bin"; do
+        case $f in *.asm|*.txt|*.cpp|*.sh) continue;; esac
+        "$sim" -labels "$f" > "$work/labels.asm"
+        nasm -f bin -o "$work/labels.bin" "$work/labels.asm" || fail "nasm rejects -labels output of $f"
+        cmp -s "$f" "$work/labels.bin" || fail "-labels output of $f reassembles to other bytes"
+    done
+else
+    echo "skipped the -labels round trip, nasm is not installed"
+fi
+
+echo "all checks passed"